@@ -2,6 +2,10 @@
 #include <iostream>
 #include <unordered_map>
 #include <queue>
+#include <algorithm>
+#include <memory>
+#include <atomic>
+#include <functional>
 #include <omp.h>
 #include <mpi.h>
 // #include <chrono>   
@@ -37,8 +41,13 @@ public:
     // 根据id，在freqs中查找/修改一个value的频数
     unordered_map<int, int> freqs;
 
+    // 扁平化布局中的位置，由model::BuildFlat或model::load_mapped设置，参见model::ValueAt
+    // value_count: value的数目；pool_offset: 第一个value在字符串池中的偏移；flat_offset: 第一个value在频数/概率数组中的下标
+    int value_count = 0;
+    size_t pool_offset = 0;
+    size_t flat_offset = 0;
 
-    void insert(string value);
+    void insert(const string &value);
     void order();
     void PrintValues();
 };
@@ -49,22 +58,15 @@ public:
     // 例如，L6D1的content大小为2，content[0]为L6，content[1]为D1
     vector<segment> content;
 
-    // pivot值，参见PCFG的原理
-    int pivot = 0;
-    void insert(segment seg);
+    void insert(const segment &seg);
     void PrintPT();
 
-    // 导出新的PT
-    vector<PT> NewPTs();
-
-    // 记录当前每个segment（除了最后一个）对应的value，在模型中的下标
+    // 模型中的PT各segment都还没有被实例化，下标全部为0
+    // 优先队列中的PT使用PTRecord表示，参见PTTemplate/PTRecord
     vector<int> curr_indices;
 
-    // 记录当前每个segment（除了最后一个）对应的value，在模型中的最大下标（即最大可以是max_indices[x]-1）
-    vector<int> max_indices;
     // void init();
     float preterm_prob;
-    float prob;
 };
 
 class model
@@ -102,14 +104,49 @@ public:
     // unordered_map: 无序映射
     int total_preterm = 0;
     vector<PT> preterminals;
-    int FindPT(PT pt);
+    int FindPT(const PT &pt) const;
 
     vector<segment> letters;
     vector<segment> digits;
     vector<segment> symbols;
-    int FindLetter(segment seg);
-    int FindDigit(segment seg);
-    int FindSymbol(segment seg);
+    int FindLetter(const segment &seg) const;
+    int FindDigit(const segment &seg) const;
+    int FindSymbol(const segment &seg) const;
+
+    // 查找表，使上面的Find函数都是O(1)的
+    // segment_ids[type][length]: 类型为type、长度为length的segment在letters/digits/symbols中的下标，-1表示不存在
+    vector<int> segment_ids[4];
+    // PT的签名（由各segment的type和length计算的整数）到其在preterminals中下标的映射，查找时不需要构造字符串
+    unordered_multimap<size_t, int> pt_ids;
+    static size_t PTSignature(const PT &pt);
+
+    // 找到一个segment在模型中对应的统计数据，type为1/2/3时分别在letters/digits/symbols中查找
+    // 调用者需要保证这个segment在模型中存在
+    segment &GetSegment(const segment &seg)
+    {
+        return type_segments(seg.type)[segment_ids[seg.type][seg.length]];
+    }
+    const segment &GetSegment(const segment &seg) const
+    {
+        return const_cast<model *>(this)->GetSegment(seg);
+    }
+    vector<segment> &type_segments(int type)
+    {
+        return type == 1 ? letters : (type == 2 ? digits : symbols);
+    }
+    unordered_map<int, int> &type_freq(int type)
+    {
+        return type == 1 ? letters_freq : (type == 2 ? digits_freq : symbols_freq);
+    }
+    int GetNextSegmentID(int type)
+    {
+        return type == 1 ? GetNextLettersID() : (type == 2 ? GetNextDigitsID() : GetNextSymbolsID());
+    }
+
+    // 找到(type, length)对应的segment的下标，不存在时在模型中新建一个
+    int FindOrAddSegment(int type, int length);
+    // 在preterminals中登记一个新的PT，返回其下标
+    int AddPT(const PT &pt);
 
     unordered_map<int, int> preterm_freq;
     unordered_map<int, int> letters_freq;
@@ -121,14 +158,65 @@ public:
     // 给定一个训练集，对模型进行训练
     void train(string train_path);
 
-    // 对已经训练的模型进行保存
-    void store(string store_path);
-
-    // 从现有的模型文件中加载模型
-    void load(string load_path);
+    // 多线程训练：将训练集按字节切分为n_threads个连续的分片，各线程直接读取自己的分片并在私有模型上统计，最后按分片顺序合并
+    // 合并后的模型与串行训练得到的模型完全一致（包括各PT/segment/value的id顺序）
+    void train(string train_path, int n_threads);
+
+    // 将另一个模型的统计数据累加到当前模型中。other中新出现的PT/segment/value按照其在other中的id顺序追加
+    void merge(const model &other);
+
+    // 对已经训练（并且已经order）的模型进行保存
+    // 文件为二进制格式，只包含猜测生成所需的数据：PT及其频数、各segment按概率排序的value和频数，以及排好序的ordered_pts
+    // 返回值表示是否保存成功
+    bool store(string store_path);
+
+    // 从现有的模型文件中加载模型，加载后的模型可以直接用于PriorityQueue::init，不需要再调用order
+    // 注意：模型文件中不包含segment中未排序的values/freqs，因此加载后的模型不能继续训练或merge
+    // 文件不存在、格式或版本不匹配时返回false，此时模型保持为空
+    bool load(string load_path);
+
+    // 模型的二进制序列化，store/load在此基础上读写文件
+    void serialize(string &buf) const;
+    bool deserialize(const char *data, size_t size);
+
+    // 可以直接mmap使用的模型文件。所有segment的value存放在一个连续的字符串池中，频数和概率存放在扁平数组中
+    // load_mapped只解析少量的PT/segment元数据，字符串池和各数组直接指向映射的文件，同一节点上的所有进程共享一份page cache
+    // 文件中记录了训练集train_path的路径、大小、修改时间以及口令上限，加载时任何一项与当前的训练集不一致都返回false，调用者应重新训练
+    bool store_mapped(string store_path, string train_path);
+    bool load_mapped(string load_path, string train_path);
+
+    // 猜测生成时使用的扁平化segment数据，在order()/load()之后由BuildFlat构建，或者由load_mapped直接指向映射的文件
+    // 同一个segment的所有value长度都等于segment的length，因此第i个value位于字符串池的 pool_offset + i * length 处，不需要为每个value记录偏移
+    string value_pool;
+    vector<int> flat_freqs;
+    vector<float> flat_probs;
+    const char *mapped_pool = nullptr;
+    const int *mapped_freqs = nullptr;
+    const float *mapped_probs = nullptr;
+    // 持有映射的内存区域，最后一个引用释放时munmap
+    shared_ptr<const void> mapping;
+    void BuildFlat();
+
+    // 第i个value的起始地址（长度为seg.length，不以'\0'结尾）
+    const char *ValueAt(const segment &seg, int i) const
+    {
+        return (mapped_pool ? mapped_pool : value_pool.data()) + seg.pool_offset + (size_t)i * seg.length;
+    }
+    // 第i个value的频数，以及其在该segment中的概率（频数/total_freq）
+    int FreqAt(const segment &seg, int i) const
+    {
+        return (mapped_freqs ? mapped_freqs : flat_freqs.data())[seg.flat_offset + i];
+    }
+    float ProbAt(const segment &seg, int i) const
+    {
+        return (mapped_probs ? mapped_probs : flat_probs.data())[seg.flat_offset + i];
+    }
 
     // 对一个给定的口令进行切分
-    void parse(string pw);
+    void parse(const string &pw);
+
+    // 将parse切分出的一个segment value计入统计，并追加到pt中
+    void InsertSegment(PT &pt, int type, const string &value);
 
     void order();
 
@@ -136,40 +224,368 @@ public:
     void print();
 };
 
+// 按块广播一段字节数据（root进程发送，其余进程接收），用于广播序列化的模型和测试数据
+void BroadcastBuffer(string &buf, int root);
+
+// 优先队列中的PT由两部分组成：
+// PTTemplate是一个preterminal不变的部分（各segment及其value数目、preterm_prob），由它派生出的所有PT共享同一个模板
+// PTRecord是随PT变化的部分（模板编号、pivot、概率、各segment当前的下标），大小固定为64字节
+struct PTTemplate
+{
+    // 各segment在模型中对应的统计数据，模型训练/加载完成之后地址不再变化
+    vector<const segment *> segs;
+    // 各segment在模型中一共有多少个value（下标最大可以是max_indices[x]-1）
+    vector<int> max_indices;
+    float preterm_prob;
+};
+
+class PTRecord
+{
+public:
+    // 下标不超过INLINE个（即不超过INLINE+1个segment）时直接存放在记录内部，复制记录不需要任何堆分配
+    // 更长的PT非常少见，其下标存放在堆上
+    static const int INLINE = 10;
+
+    float prob = 0;
+    // 模板在PriorityQueue::templates中的下标
+    int tmpl = 0;
+    // pivot值，参见PCFG的原理
+    short pivot = 0;
+    // 当前每个segment（除了最后一个）对应的value在模型中的下标的个数，即segment数目减1
+    short n = 0;
+
+    PTRecord() {}
+    PTRecord(int tmpl, int n) : tmpl(tmpl), n(n)
+    {
+        if (n > INLINE)
+        {
+            ext = new int[n];
+        }
+        fill(indices(), indices() + n, 0);
+    }
+    PTRecord(const PTRecord &o) : prob(o.prob), tmpl(o.tmpl), pivot(o.pivot), n(o.n)
+    {
+        if (n > INLINE)
+        {
+            ext = new int[n];
+        }
+        copy(o.indices(), o.indices() + n, indices());
+    }
+    PTRecord(PTRecord &&o) noexcept : prob(o.prob), tmpl(o.tmpl), pivot(o.pivot), n(o.n), ext(o.ext)
+    {
+        if (!ext)
+        {
+            copy(o.local, o.local + n, local);
+        }
+        o.ext = nullptr;
+        o.n = 0;
+    }
+    PTRecord &operator=(PTRecord &&o) noexcept
+    {
+        if (this != &o)
+        {
+            delete[] ext;
+            prob = o.prob;
+            tmpl = o.tmpl;
+            pivot = o.pivot;
+            n = o.n;
+            ext = o.ext;
+            if (!ext)
+            {
+                copy(o.local, o.local + n, local);
+            }
+            o.ext = nullptr;
+            o.n = 0;
+        }
+        return *this;
+    }
+    PTRecord &operator=(const PTRecord &o)
+    {
+        PTRecord tmp(o);
+        return *this = std::move(tmp);
+    }
+    ~PTRecord() { delete[] ext; }
+
+    // 记录当前每个segment（除了最后一个）对应的value，在模型中的下标
+    int *indices() { return ext ? ext : local; }
+    const int *indices() const { return ext ? ext : local; }
+
+private:
+    int *ext = nullptr;
+    int local[INLINE];
+};
+
+// PT优先队列中的一条记录：PT本身存放在PTQueue的slots中，队列后端只移动这样的小记录
+struct PTEntry
+{
+    float prob;
+    unsigned int slot;
+    unsigned long long seq;
+};
+
+// 4叉堆后端，按概率严格降序出队
+// 出队顺序：概率高的先出队；概率相同时，先入队的先出队（序号小的优先）
+// 这与原来线性插入的语义一致：新的PT总是插入到所有概率相同的PT之后
+class PTHeap
+{
+public:
+    static const int D = 4;
+    vector<PTEntry> heap;
+
+    bool empty() const { return heap.empty(); }
+    size_t size() const { return heap.size(); }
+    void push(const PTEntry &e);
+    PTEntry pop();
+
+private:
+    // a是否应该排在b的前面
+    static bool before(const PTEntry &a, const PTEntry &b)
+    {
+        return a.prob > b.prob || (a.prob == b.prob && a.seq < b.seq);
+    }
+    void sift_up(size_t i);
+    void sift_down(size_t i);
+};
+
+// 按对数概率分桶的后端，入队和出队均摊O(1)
+// 第b个桶存放 -log2(prob) 落在 [b/per_octave, (b+1)/per_octave) 内的PT，即每个桶覆盖 2^(1/per_octave) 倍的概率范围
+// 出队总是取概率最高的非空桶，桶内按入队顺序（FIFO）出队，因此出队的PT与真正的最大概率相差不超过 2^(1/per_octave) 倍
+class PTBucketQueue
+{
+public:
+    int per_octave = 16;
+    vector<vector<PTEntry>> buckets;
+    // 每个桶中下一个出队元素的位置
+    vector<size_t> heads;
+    // 概率最高的非空桶（下标最小）
+    size_t cursor = 0;
+    size_t count = 0;
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+    size_t BucketOf(float prob) const;
+    void push(const PTEntry &e);
+    PTEntry pop();
+};
+
+// PT优先队列，可以在运行时选择后端：默认使用4叉堆（严格按概率出队），也可以使用分桶队列（近似按概率出队）
+// PT本身存放在slots中（空闲槽位复用），各后端只存放PTEntry
+class PTQueue
+{
+public:
+    vector<PTRecord> slots;
+    vector<unsigned int> free_slots;
+    unsigned long long next_seq = 0;
+
+    bool use_buckets = false;
+    PTHeap heap;
+    PTBucketQueue buckets;
+
+    // 切换到分桶后端，需要在队列为空时调用。per_octave越大，出队顺序越接近严格的概率顺序
+    void UseBuckets(int per_octave);
+
+    bool empty() const { return use_buckets ? buckets.empty() : heap.empty(); }
+    size_t size() const { return use_buckets ? buckets.size() : heap.size(); }
+
+    // 入队，使用pt.prob作为优先级
+    void push(PTRecord &&pt) { push(std::move(pt), next_seq++); }
+    void push(const PTRecord &pt) { push(PTRecord(pt)); }
+    // 使用预留的序号入队（序号决定概率相同时的出队顺序），用于惰性初始化
+    void push(PTRecord &&pt, unsigned long long seq);
+    // 概率为prob的PT如果现在入队，是否可能先于当前的队首出队（队列为空时为true）
+    bool MayPrecede(float prob) const;
+    // 出队，返回概率最高（分桶后端为近似最高）的PT
+    PTRecord pop();
+
+    // 出队顺序保真度统计，仅分桶后端、并且track_fidelity为true时记录
+    // 每次出队时与当前桶内真正的最大概率比较：out_of_order为顺序不严格的出队次数，worst/sum_ratio为最大概率与出队概率之比
+    bool track_fidelity = false;
+    long long pops = 0;
+    long long out_of_order = 0;
+    double worst_ratio = 1;
+    double sum_ratio = 0;
+    void PrintFidelity();
+};
+
+// 多线程并发使用的松弛优先队列（MultiQueue）
+// 由若干个带锁的子堆组成：入队时随机选一个子堆；出队时随机选两个子堆，从队首概率较高的那个出队
+// 不存在全局锁，代价是出队顺序只是近似的概率顺序，可以通过rank error统计衡量偏差
+class PTMultiQueue
+{
+public:
+    struct alignas(64) SubQueue
+    {
+        atomic_flag lock = ATOMIC_FLAG_INIT;
+        PTHeap heap;
+        vector<PTRecord> slots;
+        vector<unsigned int> free_slots;
+        unsigned long long next_seq = 0;
+        // 队首PT的概率，子堆为空时为-1，供其他线程无锁读取
+        atomic<float> top_prob{-1};
+    };
+
+    // 子堆数目为 queues_per_thread * n_threads
+    PTMultiQueue(int n_threads, int queues_per_thread = 2);
+
+    void push(PTRecord &&pt);
+    // 出队一个PT，所有子堆都为空时返回false
+    bool try_pop(PTRecord &pt);
+    long long size() const { return count.load(); }
+    // 各子堆队首概率的最大值，全部为空时为-1。与其他线程的入队、出队并发时只是近似值
+    float TopProb() const;
+
+    // rank error统计：每次出队时，统计队首概率严格高于出队PT的子堆个数
+    // 这是出队PT在全部PT中排名误差的一个下界，开销为每次出队扫描一遍各子堆的队首
+    bool track_rank_error = false;
+    atomic<long long> pops{0};
+    atomic<long long> rank_error_sum{0};
+    atomic<long long> rank_error_max{0};
+
+private:
+    unique_ptr<SubQueue[]> queues;
+    int n_queues;
+    atomic<long long> count{0};
+    static unsigned int Random();
+    void Lock(SubQueue &q);
+    void Unlock(SubQueue &q);
+};
+
+// 紧凑的猜测缓冲区：所有猜测首尾相接地存放在一个字节数组中，offsets记录每个猜测的起止位置
+// 第i个猜测为 bytes[offsets[i], offsets[i+1])，不以'\0'结尾
+// 一批猜测处理完之后调用clear，已经分配的内存会保留下来，之后的批次只要不超过历史最大值就不会再分配内存
+class GuessBuffer
+{
+public:
+    string bytes;
+    vector<size_t> offsets{0};
+
+    size_t size() const { return offsets.size() - 1; }
+    bool empty() const { return offsets.size() == 1; }
+    void clear()
+    {
+        bytes.clear();
+        offsets.resize(1);
+    }
+    void reserve(size_t n_guesses, size_t n_bytes)
+    {
+        offsets.reserve(n_guesses + 1);
+        bytes.reserve(n_bytes);
+    }
+
+    // 追加一个猜测，内容为prefix和suffix的拼接
+    void push(const char *prefix, size_t prefix_len, const char *suffix, size_t suffix_len)
+    {
+        bytes.append(prefix, prefix_len).append(suffix, suffix_len);
+        offsets.emplace_back(bytes.size());
+    }
+    void push(const char *data, size_t len)
+    {
+        bytes.append(data, len);
+        offsets.emplace_back(bytes.size());
+    }
+    // 把另一个缓冲区中的全部猜测追加到末尾
+    void append(const GuessBuffer &other)
+    {
+        size_t base = bytes.size();
+        bytes.append(other.bytes);
+        for (size_t i = 1; i < other.offsets.size(); i += 1)
+        {
+            offsets.emplace_back(base + other.offsets[i]);
+        }
+    }
+
+    const char *data(size_t i) const { return bytes.data() + offsets[i]; }
+    size_t length(size_t i) const { return offsets[i + 1] - offsets[i]; }
+    // 第i个猜测的string副本，只用于调试和输出
+    string str(size_t i) const { return string(data(i), length(i)); }
+};
+
 // 优先队列，用于按照概率降序生成口令猜测
 // 实际上，这个class负责队列维护、口令生成、结果存储的全部过程
 class PriorityQueue
 {
 public:
-    // 用vector实现的priority queue
-    vector<PT> priority;
+    // priority queue，默认使用堆实现，可以通过priority.UseBuckets切换为分桶实现
+    PTQueue priority;
 
     // 模型作为成员，辅助猜测生成
     model m;
 
+    // 各preterminal的模板，下标与ordered_pts相同，在PT第一次入队时构建
+    vector<PTTemplate> templates;
+
     // 计算一个pt的概率
-    void CalProb(PT &pt);
+    void CalProb(PTRecord &pt) const;
+    // pt的第i个下标加1之后的新PT的概率，结果与对新PT调用CalProb相同
+    float ChildProb(const PTRecord &pt, int i) const;
 
     // 优先队列的初始化
     void init();
 
-    int mpi_rank;
-    int mpi_size;
-    void GenerateMPI(PT pt);
+    // 惰性初始化：ordered_pts按preterm_prob降序排列，而一个PT实例化之后的概率不会超过它的preterm_prob
+    // 因此init时不把所有PT放入队列，只有当ordered_pts中下一个PT的preterm_prob可能超过队首的概率时，才把它实例化并入队
+    // 每个PT使用其在ordered_pts中的下标作为序号入队，出队顺序与一次性全部入队时完全相同
+    // next_seed: ordered_pts中下一个还没有入队的PT的下标
+    size_t next_seed = 0;
+    // 为ordered_pts[next_seed]构建模板，把各下标都为0的PT入队
+    void SeedNext();
+    // 同SeedNext，但是不入队，而是返回这个PT（PopParallel用它向MultiQueue入队）
+    PTRecord MakeSeed();
+    // 每次出队之后调用，放入所有可能先于队首出队的PT
+    void Seed();
+
+    // 不使用MPI时（例如main.cpp），相当于只有一个进程
+    int mpi_rank = 0;
+    int mpi_size = 1;
+    void GenerateMPI(const PTRecord &pt);
     // 对优先队列的一个PT，生成所有guesses
-    void Generate(PT pt);
+    void Generate(const PTRecord &pt);
+    // 同上，但把生成的猜测追加到out中，不修改队列的任何状态，可以被多个线程同时调用
+    void Generate(const PTRecord &pt, GuessBuffer &out) const;
+
+    // 出队PT之后的新PT导出规则
+    // 默认使用pivot规则；deadbeat为true时使用"deadbeat dad"规则：
+    // 一个PT的父PT是把某个segment的下标减1得到的PT，可能有多个。只有其中概率最低的父PT（概率相同时取位置最小的）负责将其入队，
+    // 这时其余的父PT一般都已经出队，所以新PT入队得更晚，队列中同时存在的PT少得多
+    // 两种规则生成的猜测集合相同，出队的概率序列也相同，只是概率相同的PT之间的先后可能不同
+    bool deadbeat = false;
+    // 按照上面的规则导出pt的所有新PT，计算其概率后追加到out中
+    void NewPTs(PTRecord &pt, vector<PTRecord> &out) const;
+
+    // 生成与哈希融合：把pt的每个猜测直接写入MD5Hash_SIMD_Blocks的通道交错布局并就地哈希，不构造任何string
+    // 每个猜测的4个字（与MD5Hash的输出格式相同）按照生成顺序追加到digests中，第i个结果对应最后一个segment的第i个value
+    // 同一个PT的所有猜测长度相同，前缀只需要写入一次，之后每4个猜测只改写最后一个segment所在的字节
+    void GenerateHash(const PTRecord &pt, vector<unsigned int> &digests) const;
 
     // 将优先队列最前面的一个PT
     void PopNext();
+    // 同PopNext，但是使用GenerateHash，结果追加到digests中
+    void PopNextHash(vector<unsigned int> &digests);
+    // 导出pt的新PT并入队
+    void PushNewPTs(PTRecord &pt);
+    // PopNext导出新PT时复用的缓冲区
+    vector<PTRecord> new_pts;
     int total_guesses = 0;
-    vector<string> guesses;
+    // 生成的猜测，处理（哈希）完一批之后调用guesses.clear()
+    GuessBuffer guesses;
 
     // 新增：PT层面的并行处理函数
     void PopNextBatch(int batch_size = 4);
     
     // 新增：处理单个PT并返回新生成的PT列表
-    vector<PT> ProcessSinglePT(PT pt);
+    vector<PTRecord> ProcessSinglePT(PTRecord pt);
 
-    void InsertNewPTs(const vector<PT>& new_pts);
+    // 多线程生成：把priority中的PT移入mq，由n_threads个线程各自出队PT、生成猜测、将新PT入队，不使用全局锁
+    // 每个线程的猜测攒够batch_size个（以及结束时）调用一次consume，consume会被多个线程同时调用，需要自行保证线程安全
+    // 还没有入队的PT与Seed一样惰性入队，只有可能先于mq队首出队时才实例化
+    // 累计生成的猜测达到max_guesses时停止，剩余的PT放回priority，还没有入队的PT留给之后的Seed；返回生成的猜测总数。rank error等统计保存在mq中
+    long long PopParallel(PTMultiQueue &mq, int n_threads, long long max_guesses,
+                          const function<void(GuessBuffer &)> &consume, size_t batch_size = 100000);
+
+    void InsertNewPTs(vector<PTRecord>& new_pts);
     void BroadcastPriorityQueue();
+
+    // 由root进程把模型序列化后广播给所有进程，其余进程不需要读取训练集
+    // root进程调用前需要已经完成训练（或加载），返回广播所用的时间（秒）
+    double BroadcastModel(int root = 0);
 };
@@ -3,6 +3,10 @@
 #include <fstream>
 #include "md5.h"
 #include <iomanip>
+#include <set>
+#include <mutex>
+#include <algorithm>
+#include <unistd.h>
 using namespace std;
 using namespace chrono;
 
@@ -10,6 +14,97 @@ using namespace chrono;
 // g++ correctness.cpp train.cpp guessing.cpp md5.cpp -o main
 
 
+// 队列测试使用的小训练集：包含单segment和多segment的PT，以及频数相同的value，全部PT都可以在测试中出队完毕
+static const char *SMALL_CORPUS[] = {
+    "password", "123456", "abc123", "abc123!", "love99", "love88", "love99!", "qwe!1", "hello1", "hello2",
+    "dragon12", "iloveyou", "monkey1", "1q2w3e", "a1b2c3", "x!y", "zz99zz", "sun#2", "moon#22", "12ab!",
+    "99ab?", "star1", "star12", "cat7", "dog7", "7dog", "ab!12", "cd?34", "hi!", "$100",
+    "pass#word1", "abc123", "love99", "123456", "hello1", "7dog", "$200", "ab!12", "qwe!2", "1q2w3e"
+};
+
+// 训练时SMALL_CORPUS重复多次，其中的PT概率明显更高，惰性初始化时其余的PT不会在一开始就入队
+// 再用固定种子的线性同余生成器拼出一批多segment的口令，各value的频数各不相同，同一个PT可以由多个父PT导出
+static const char *SMALL_WORDS[] = {"love", "abc", "qwe", "star", "moon", "dog", "cat", "hello", "sun", "pass", "x", "zz"};
+static const char *SMALL_SYMBOLS[] = {"!", "#", "?", "$", "!!", "@"};
+
+static vector<string> SmallPasswords()
+{
+    vector<string> passwords;
+    for (int i = 0; i < 50; i++) {
+        passwords.insert(passwords.end(), begin(SMALL_CORPUS), end(SMALL_CORPUS));
+    }
+    unsigned int x = 12345;
+    for (int i = 0; i < 3000; i++) {
+        x = x * 1103515245 + 12345;
+        unsigned int r = x >> 8;
+        string pw = r % 3 == 0 ? "" : SMALL_WORDS[r % 97 % 12];
+        pw += to_string((r >> 4) % 13 * ((r >> 9) % 7 + 1));
+        pw += (r >> 15) % 2 == 0 ? "" : SMALL_SYMBOLS[(r >> 12) % 6];
+        pw += SMALL_WORDS[(r >> 17) % 12];
+        pw += to_string((r >> 21) % 5);
+        passwords.push_back(pw);
+    }
+    return passwords;
+}
+
+static void TrainSmall(model &m)
+{
+    for (const string &pw : SmallPasswords()) {
+        m.parse(pw);
+    }
+    m.order();
+}
+
+// 把SmallPasswords写入一个临时的训练集文件，口令之间交替使用各种空白分隔符（包括开头的空白和末尾没有换行），返回文件路径
+static string WriteSmallTrainSet()
+{
+    const char *separators[] = {"\n", "\r\n", " ", "\t", "\n\n", "  \n"};
+    string text = "  ";
+    vector<string> passwords = SmallPasswords();
+    for (size_t i = 0; i < passwords.size(); i++) {
+        text += passwords[i];
+        if (i + 1 < passwords.size()) {
+            text += separators[i % 6];
+        }
+    }
+    char path[] = "/tmp/correctness_train_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd >= 0) {
+        ofstream(path, ios::binary) << text;
+        close(fd);
+    }
+    return path;
+}
+
+// 按出队顺序记录的PT：出队时的概率、对这个PT调用CalProb得到的概率，以及唯一标识这个PT的模板编号和各下标
+struct PoppedPT
+{
+    float prob;
+    float full_prob;
+    vector<int> key;
+};
+
+// 初始化q并把q中的PT全部出队，每次出队之后按照q的规则导出新PT
+// eager为true时在第一次出队之前就放入ordered_pts中的全部PT，不使用惰性初始化
+static vector<PoppedPT> PopAll(PriorityQueue &q, bool eager)
+{
+    q.init();
+    while (eager && q.next_seed < q.m.ordered_pts.size()) {
+        q.SeedNext();
+    }
+    vector<PoppedPT> popped;
+    while (!q.priority.empty()) {
+        PTRecord pt = q.priority.pop();
+        PTRecord full = pt;
+        q.CalProb(full);
+        PoppedPT rec{pt.prob, full.prob, {pt.tmpl}};
+        rec.key.insert(rec.key.end(), pt.indices(), pt.indices() + pt.n);
+        popped.push_back(rec);
+        q.PushNewPTs(pt);
+    }
+    return popped;
+}
+
 // 通过这个函数，你可以验证你实现的SIMD哈希函数的正确性
 int main()
 {
@@ -96,7 +191,410 @@ int main()
     }
     
     cout << "八线程验证结果: " << (match8 ? "全部相同" : "存在不同") << endl;
+    cout << endl;
+
+    // 验证长度（块数）不同的4个输入，以及末尾不足4个的一组
+    cout << "验证不同长度的输入:" << endl;
+    string mixed[4] = {"", input.substr(0, 55), input.substr(0, 56), input};
+    const char *mixed_inputs[4];
+    size_t mixed_lengths[4];
+    for (int i = 0; i < 4; i++) {
+        mixed_inputs[i] = mixed[i].data();
+        mixed_lengths[i] = mixed[i].length();
+    }
+    bool match_mixed = true;
+    for (int count = 1; count <= 4; count++) {
+        bit32 mixed_states[4][4];
+        MD5Hash_SIMD(mixed_inputs, mixed_lengths, count, mixed_states);
+        for (int i = 0; i < count; i++) {
+            bit32 expected[4];
+            MD5Hash(mixed[i], expected);
+            for (int j = 0; j < 4; j++) {
+                if (expected[j] != mixed_states[i][j]) {
+                    match_mixed = false;
+                }
+            }
+        }
+    }
+    cout << "不同长度验证结果: " << (match_mixed ? "全部相同" : "存在不同") << endl;
+    cout << endl;
+
+    // 逐个验证当前CPU支持的SIMD后端（x86上为SSE2/AVX2/AVX-512，ARM上为NEON），以标量MD5Hash为参照
+    MD5Backend best = MD5CurrentBackend();
+    for (MD5Backend backend : {MD5_BACKEND_NEON, MD5_BACKEND_SSE2, MD5_BACKEND_AVX2, MD5_BACKEND_AVX512}) {
+        if (!MD5UseBackend(backend)) {
+            continue;
+        }
+        int width = MD5BackendWidth();
+        string lanes[16];
+        const char *lane_inputs[16];
+        size_t lane_lengths[16];
+        for (int i = 0; i < width; i++) {
+            lanes[i] = input.substr(0, i * 13 % input.length());
+            lane_inputs[i] = lanes[i].data();
+            lane_lengths[i] = lanes[i].length();
+        }
+        bit32 lane_states[16][4];
+        MD5Hash_Wide(lane_inputs, lane_lengths, lane_states);
+        bool match_backend = true;
+        for (int i = 0; i < width; i++) {
+            bit32 expected[4];
+            MD5Hash(lanes[i], expected);
+            for (int j = 0; j < 4; j++) {
+                if (expected[j] != lane_states[i][j]) {
+                    match_backend = false;
+                }
+            }
+        }
+        cout << MD5BackendName(backend) << "（" << dec << width << "路）验证结果: " << (match_backend ? "全部相同" : "存在不同") << endl;
+
+        // 批量接口：个数不是通道数的倍数，长度覆盖单块、多块以及各桶剩下的输入
+        vector<string> batch;
+        bool match_batch = true;
+        for (size_t i = 0; i < 1000; i++) {
+            batch.push_back(input.substr(i * 7 % input.length(), i % 5 == 0 ? i % 200 : i % 30));
+        }
+        for (size_t n : {0, 1, 3, 17, 1000}) {
+            vector<const uint8_t *> ptrs(n);
+            vector<uint32_t> lens(n);
+            vector<MD5Digest> digests(n);
+            for (size_t i = 0; i < n; i++) {
+                ptrs[i] = (const uint8_t *)batch[i].data();
+                lens[i] = batch[i].length();
+            }
+            MD5Hash_Batch(ptrs.data(), lens.data(), n, digests.data());
+            for (size_t i = 0; i < n; i++) {
+                bit32 expected[4];
+                MD5Hash(batch[i], expected);
+                if (memcmp(expected, digests[i].state, sizeof(expected)) != 0) {
+                    match_batch = false;
+                }
+            }
+        }
+        cout << MD5BackendName(backend) << " 批量接口验证结果: " << (match_batch ? "全部相同" : "存在不同") << endl;
+
+        // 匹配接口：长度0到55的输入在单块版本中直接与目标比较，更长的输入算出结果之后再比较
+        // 每种单块长度各32个输入，恰好是各后端通道数的整数倍，都会进入单块版本；只取一部分输入时还会剩下不足一组的输入
+        // 目标为1、2、16个，取自分布在各种长度上的输入的结果（第一个目标分别取自空输入、单块的输入和多块的输入）
+        // 另外每个目标各改动一个字（依次改动不同的字），这时不应有任何命中
+        vector<string> match_inputs;
+        for (size_t i = 0; i < 32 * (MD5_ONE_BLOCK_MAX + 1); i++) {
+            match_inputs.push_back(input.substr(i / (MD5_ONE_BLOCK_MAX + 1), i % (MD5_ONE_BLOCK_MAX + 1)));
+        }
+        for (size_t i = 0; i < 200; i++) {
+            match_inputs.push_back(input.substr(i % 29, 56 + i % 150));
+        }
+        vector<const uint8_t *> match_ptrs;
+        vector<uint32_t> match_lens;
+        vector<MD5Digest> match_digests(match_inputs.size());
+        for (size_t i = 0; i < match_inputs.size(); i++) {
+            match_ptrs.push_back((const uint8_t *)match_inputs[i].data());
+            match_lens.push_back(match_inputs[i].length());
+            MD5Hash(match_inputs[i], match_digests[i].state);
+        }
+        bool match_small = true;
+        for (size_t first : {(size_t)0, (size_t)6, match_inputs.size() - 5}) {
+            for (int n_targets : {1, 2, MD5_SMALL_TARGETS_MAX}) {
+                for (int flipped = -1; flipped < 4; flipped++) {
+                    MD5Digest targets[MD5_SMALL_TARGETS_MAX];
+                    for (int k = 0; k < n_targets; k++) {
+                        targets[k] = match_digests[(k * 37 + first) % match_inputs.size()];
+                        if (flipped >= 0) {
+                            targets[k].state[(k + flipped) % 4] ^= 1u << k;
+                        }
+                    }
+                    MD5SmallTargetSet small_targets;
+                    small_targets.assign(targets, n_targets);
+                    for (size_t n : {(size_t)5, match_inputs.size() - 203, match_inputs.size()}) {
+                        vector<size_t> expected_hits;
+                        for (size_t i = 0; i < n; i++) {
+                            if (small_targets.contains(match_digests[i].state)) {
+                                expected_hits.push_back(i);
+                            }
+                        }
+                        vector<size_t> hits;
+                        MD5Match_Batch(match_ptrs.data(), match_lens.data(), n, small_targets, hits);
+                        if (hits != expected_hits || (flipped >= 0 && !hits.empty()) || (flipped < 0 && n == match_inputs.size() && hits.empty())) {
+                            match_small = false;
+                        }
+                    }
+                }
+            }
+        }
+        cout << MD5BackendName(backend) << " 匹配接口验证结果: " << (match_small ? "全部相同" : "存在不同") << endl;
+    }
+    MD5UseBackend(best);
+
+    // 验证流式接口：长度覆盖0到若干个块，输入按不同的大小分段调用MD5Update（包括逐字节、恰好在块边界处分段以及跨过块边界的分段）
+    string long_input;
+    while (long_input.length() < 300) {
+        long_input += input;
+    }
+    long_input.resize(300);
+    bool match_stream = true;
+    for (size_t length = 0; length <= long_input.length(); length++) {
+        bit32 expected[4];
+        MD5Hash(long_input.data(), length, expected);
+        for (size_t chunk : {1, 7, 55, 56, 63, 64, 65, 128, 300}) {
+            MD5Context ctx;
+            MD5Init(ctx);
+            for (size_t offset = 0; offset < length; offset += chunk) {
+                MD5Update(ctx, long_input.data() + offset, min(chunk, length - offset));
+            }
+            bit32 streamed[4];
+            MD5Final(ctx, streamed);
+            if (memcmp(expected, streamed, sizeof(expected)) != 0) {
+                match_stream = false;
+            }
+        }
+        // 在每个位置分成两段，中间再插入一次长度为0的输入
+        for (size_t split = 0; split <= length; split++) {
+            MD5Context ctx;
+            MD5Init(ctx);
+            MD5Update(ctx, long_input.data(), split);
+            MD5Update(ctx, long_input.data() + split, 0);
+            MD5Update(ctx, long_input.data() + split, length - split);
+            bit32 streamed[4];
+            MD5Final(ctx, streamed);
+            if (memcmp(expected, streamed, sizeof(expected)) != 0) {
+                match_stream = false;
+            }
+        }
+    }
+    cout << "流式接口验证结果: " << (match_stream ? "全部相同" : "存在不同") << endl;
+
+    // 验证MD5TargetSet：每3个输入取1个作为目标（另外重复加入一个），查找全部输入的结果以及与目标只差一个字的结果
+    // find与contains都只能命中目标，下标按顺序排列；序列化之后再反序列化得到相同的集合，损坏的数据被拒绝，集合变为空
+    vector<MD5Digest> all_digests(2000);
+    for (size_t i = 0; i < all_digests.size(); i++) {
+        MD5Hash(long_input.substr(i % 300, i % 7 == 0 ? i % 250 : i % 40) + to_string(i), all_digests[i].state);
+    }
+    vector<MD5Digest> target_digests;
+    for (size_t i = 0; i < all_digests.size(); i += 3) {
+        target_digests.push_back(all_digests[i]);
+    }
+    target_digests.push_back(all_digests[0]);
+    vector<MD5Digest> queries = all_digests;
+    vector<size_t> expected_hits;
+    for (size_t i = 0; i < all_digests.size(); i++) {
+        if (i % 3 == 0) {
+            expected_hits.push_back(i);
+            MD5Digest near = all_digests[i];
+            near.state[i / 3 % 4] ^= 1u << (i % 32);
+            queries.push_back(near);
+        }
+    }
+    MD5TargetSet target_set;
+    target_set.assign(target_digests.data(), target_digests.size());
+    bool match_targets = target_set.size() == target_digests.size() - 1;
+    vector<size_t> hits;
+    target_set.find(queries.data(), queries.size(), hits);
+    match_targets = match_targets && hits == expected_hits;
+    for (size_t i = 0; i < queries.size(); i++) {
+        bool expected = i < all_digests.size() && i % 3 == 0;
+        if (target_set.contains(queries[i].state) != expected) {
+            match_targets = false;
+        }
+    }
+    string target_buf;
+    target_set.serialize(target_buf);
+    MD5TargetSet received;
+    match_targets = match_targets && received.deserialize(target_buf.data(), target_buf.size()) && received.size() == target_set.size();
+    for (size_t i = 0; match_targets && i < received.size(); i++) {
+        if (memcmp(received.at(i).state, target_set.at(i).state, sizeof(MD5Digest)) != 0) {
+            match_targets = false;
+        }
+    }
+    hits.clear();
+    received.find(queries.data(), queries.size(), hits);
+    match_targets = match_targets && hits == expected_hits;
+    string unsorted_buf = target_buf;
+    swap_ranges(&unsorted_buf[0], &unsorted_buf[8], &unsorted_buf[8]);
+    for (const string &corrupt : {target_buf.substr(0, target_buf.size() - 1), unsorted_buf}) {
+        MD5TargetSet damaged;
+        damaged.assign(target_digests.data(), target_digests.size());
+        if (damaged.deserialize(corrupt.data(), corrupt.size()) || !damaged.empty()) {
+            match_targets = false;
+        }
+    }
+
+    // 从哈希列表文件读取：大小写、行首空白、行尾的其他内容和CRLF都可以解析，空行不计入跳过的行
+    string list_text = "not a hash\n\n";
+    for (size_t i = 0; i < 30; i++) {
+        const bit32 *w = target_digests[i].state;
+        char line[64];
+        snprintf(line, sizeof(line), i % 2 == 0 ? "%08x%08x%08x%08x" : "%08X%08X%08X%08X", w[0], w[1], w[2], w[3]);
+        const char *prefixes_text[] = {"", "  ", "\t"};
+        const char *suffixes_text[] = {"\n", "\r\n", ":password\n", " 123\n"};
+        list_text += string(prefixes_text[i % 3]) + line + suffixes_text[i % 4];
+    }
+    char list_path[] = "/tmp/correctness_hashes_XXXXXX";
+    int list_fd = mkstemp(list_path);
+    if (list_fd >= 0) {
+        ofstream(list_path, ios::binary) << list_text;
+        close(list_fd);
+    }
+    MD5TargetSet loaded;
+    size_t skipped = 0;
+    match_targets = match_targets && loaded.load(list_path, &skipped) && skipped == 1 && loaded.size() == 30;
+    for (size_t i = 0; i < 30; i++) {
+        if (!loaded.contains(target_digests[i].state)) {
+            match_targets = false;
+        }
+    }
+    unlink(list_path);
+    cout << "目标集合验证结果: " << (match_targets ? "全部相同" : "存在不同") << endl;
+    cout << endl;
+
+    // 验证优先队列：出队概率非增，每个PT恰好出队一次，出队的PT总数等于所有PT实例化之后的数目
+    PriorityQueue heap_q;
+    TrainSmall(heap_q.m);
+    vector<PoppedPT> heap_pops = PopAll(heap_q, false);
+    size_t expected_pops = 0;
+    for (const PT &pt : heap_q.m.ordered_pts) {
+        size_t count = 1;
+        for (size_t i = 0; i + 1 < pt.content.size(); i++) {
+            count *= heap_q.m.GetSegment(pt.content[i]).value_count;
+        }
+        expected_pops += count;
+    }
+    bool heap_ok = heap_pops.size() == expected_pops;
+    set<vector<int>> heap_keys;
+    for (size_t i = 0; i < heap_pops.size(); i++) {
+        if (i > 0 && heap_pops[i].prob > heap_pops[i - 1].prob) {
+            heap_ok = false;
+        }
+        if (!heap_keys.insert(heap_pops[i].key).second) {
+            heap_ok = false;
+        }
+    }
+    cout << "优先队列出队顺序（" << dec << heap_pops.size() << "个PT）验证结果: " << (heap_ok ? "全部正确" : "存在错误") << endl;
+
+    // 验证deadbeat dad规则：出队的概率序列与pivot规则逐个相同，出队的PT集合也相同（只有概率相同的PT之间的先后可能不同）
+    PriorityQueue deadbeat_q;
+    deadbeat_q.deadbeat = true;
+    TrainSmall(deadbeat_q.m);
+    vector<PoppedPT> deadbeat_pops = PopAll(deadbeat_q, false);
+    bool match_deadbeat = deadbeat_pops.size() == heap_pops.size();
+    set<vector<int>> deadbeat_keys;
+    for (size_t i = 0; match_deadbeat && i < deadbeat_pops.size(); i++) {
+        if (deadbeat_pops[i].prob != heap_pops[i].prob) {
+            match_deadbeat = false;
+        }
+        deadbeat_keys.insert(deadbeat_pops[i].key);
+    }
+    match_deadbeat = match_deadbeat && deadbeat_keys == heap_keys;
+    cout << "deadbeat dad规则与pivot规则验证结果: " << (match_deadbeat ? "全部相同" : "存在不同") << endl;
+
+    // 验证新PT的概率：无论由哪个父PT、哪种规则导出，都与对这个PT调用CalProb的结果逐位相同
+    bool match_prob = true;
+    for (const vector<PoppedPT> *pops : {&heap_pops, &deadbeat_pops}) {
+        for (const PoppedPT &rec : *pops) {
+            if (rec.prob != rec.full_prob) {
+                match_prob = false;
+            }
+        }
+    }
+    cout << "新PT概率与CalProb验证结果: " << (match_prob ? "全部相同" : "存在不同") << endl;
+
+    // 验证惰性初始化：与一次性放入ordered_pts中全部PT相比，出队的PT序列（包括概率相同的PT之间的先后）完全相同
+    PriorityQueue eager_q;
+    TrainSmall(eager_q.m);
+    vector<PoppedPT> eager_pops = PopAll(eager_q, true);
+    bool match_lazy = eager_pops.size() == heap_pops.size();
+    for (size_t i = 0; match_lazy && i < eager_pops.size(); i++) {
+        if (eager_pops[i].prob != heap_pops[i].prob || eager_pops[i].key != heap_pops[i].key) {
+            match_lazy = false;
+        }
+    }
+    cout << "惰性初始化验证结果: " << (match_lazy ? "全部相同" : "存在不同") << endl;
+
+    // 验证PopParallel：先多线程生成一部分猜测，再串行生成剩下的猜测，合起来与完全串行生成的猜测集合相同
+    // 多线程阶段生成第一批猜测之后就停止，这时ordered_pts中应当还有没有入队的PT（PopParallel同样是惰性初始化的）
+    PriorityQueue serial_q;
+    TrainSmall(serial_q.m);
+    serial_q.init();
+    while (!serial_q.priority.empty()) {
+        serial_q.PopNext();
+    }
+    vector<string> serial_guesses;
+    for (size_t i = 0; i < serial_q.guesses.size(); i++) {
+        serial_guesses.push_back(serial_q.guesses.str(i));
+    }
+    sort(serial_guesses.begin(), serial_guesses.end());
+
+    PriorityQueue parallel_q;
+    TrainSmall(parallel_q.m);
+    parallel_q.init();
+    PTMultiQueue mq(4);
+    vector<string> parallel_guesses;
+    mutex parallel_mutex;
+    parallel_q.PopParallel(mq, 4, 1, [&](GuessBuffer &batch) {
+        lock_guard<mutex> lock(parallel_mutex);
+        for (size_t i = 0; i < batch.size(); i++) {
+            parallel_guesses.push_back(batch.str(i));
+        }
+    }, 100);
+    bool match_parallel = parallel_q.next_seed < parallel_q.m.ordered_pts.size();
+    while (!parallel_q.priority.empty()) {
+        parallel_q.PopNext();
+    }
+    for (size_t i = 0; i < parallel_q.guesses.size(); i++) {
+        parallel_guesses.push_back(parallel_q.guesses.str(i));
+    }
+    sort(parallel_guesses.begin(), parallel_guesses.end());
+    match_parallel = match_parallel && parallel_guesses == serial_guesses;
+    cout << "PopParallel（" << serial_guesses.size() << "个猜测）验证结果: " << (match_parallel ? "全部相同" : "存在不同") << endl;
+
+    // 验证多线程训练：不同线程数训练得到的模型序列化之后与串行训练逐字节相同
+    // 串行训练的模型也应当与直接parse这些口令得到的模型相同，即各种空白分隔符都被正确地跳过
+    cout << endl;
+    string train_path = WriteSmallTrainSet();
+    model serial_m;
+    serial_m.train(train_path);
+    serial_m.order();
+    string serial_buf;
+    serial_m.serialize(serial_buf);
+    model small_m;
+    TrainSmall(small_m);
+    string small_buf;
+    small_m.serialize(small_buf);
+    bool match_train = serial_buf == small_buf;
+    for (int n_threads : {1, 2, 3, 7, 16}) {
+        model parallel_m;
+        parallel_m.train(train_path, n_threads);
+        parallel_m.order();
+        string parallel_buf;
+        parallel_m.serialize(parallel_buf);
+        if (parallel_buf != serial_buf) {
+            match_train = false;
+            cout << n_threads << "线程训练的模型不同" << endl;
+        }
+    }
+    unlink(train_path.c_str());
+    cout << "多线程训练验证结果: " << (match_train ? "全部相同" : "存在不同") << endl;
+
+    // 验证模型的序列化：反序列化之后再次序列化的结果逐字节相同，用反序列化的模型出队的PT序列与直接训练的模型相同
+    // 截断的数据应当被拒绝
+    PriorityQueue loaded_q;
+    bool match_serialize = loaded_q.m.deserialize(serial_buf.data(), serial_buf.size());
+    string loaded_buf;
+    loaded_q.m.serialize(loaded_buf);
+    match_serialize = match_serialize && loaded_buf == serial_buf;
+    vector<PoppedPT> loaded_pops = PopAll(loaded_q, false);
+    match_serialize = match_serialize && loaded_pops.size() == heap_pops.size();
+    for (size_t i = 0; match_serialize && i < loaded_pops.size(); i++) {
+        if (loaded_pops[i].prob != heap_pops[i].prob || loaded_pops[i].key != heap_pops[i].key) {
+            match_serialize = false;
+        }
+    }
+    for (size_t cut : {(size_t)0, (size_t)1, serial_buf.size() / 2, serial_buf.size() - 1}) {
+        model truncated_m;
+        if (truncated_m.deserialize(serial_buf.data(), cut)) {
+            match_serialize = false;
+        }
+    }
+    cout << "模型序列化验证结果: " << (match_serialize ? "全部相同" : "存在不同") << endl;
 
-    CleanupMD5Resources();
     return 0;
 }
\ No newline at end of file
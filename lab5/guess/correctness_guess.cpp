@@ -13,42 +13,73 @@ using namespace std;
 using namespace chrono;
 
 // 编译指令如下
-// mpicxx correctness_guess.cpp train.cpp guessing.cpp md5.cpp -o main -O2 -pthread
+// mpicxx correctness_guess.cpp train.cpp guessing.cpp md5.cpp -o main -O2 -pthread -fopenmp
 // mpirun -np 4 ./main
+// 或者：mpirun -np 4 ./main 哈希列表文件
+// 破解文件中的十六进制MD5（每行一个），统计哈希结果属于这些目标的猜测数，而不是与测试集的口令逐个比较
+// 目标不超过MD5_SMALL_TARGETS_MAX个时，在SIMD寄存器中直接与目标比较，大部分猜测不需要算完64步
 
 // 全局变量用于线程间通信
 mutex guesses_mutex;
-vector<string> pending_hash_guesses;
+GuessBuffer pending_hash_guesses;
 atomic<int> total_cracked(0);
 atomic<int> total_hashed(0);  // 统计实际哈希处理的密码数量
 atomic<bool> hash_thread_should_exit(false);
 
-// 哈希计算线程函数
-void hash_worker_thread(const unordered_set<string>& test_set, double& time_hash) {
+// 哈希计算线程函数：targets为空时按口令与测试集比较，否则检查每个猜测的MD5是否属于targets
+// small_targets不为空时（目标很少），改用MD5Match_Batch直接与这些目标比较，不再查找targets
+void hash_worker_thread(const unordered_set<string>& test_set, const MD5TargetSet *targets,
+                        const MD5SmallTargetSet *small_targets, double& time_hash) {
     auto start_hash = system_clock::now();
     
+    // 与主线程交换使用的两个缓冲区（双缓冲），各自的内存在清空后保留，稳定之后不再分配内存
+    GuessBuffer local_guesses;
+    string pw;
+    // 批量哈希的输入数组和结果，同样在各批之间复用
+    vector<const uint8_t *> ptrs;
+    vector<uint32_t> lens;
+    vector<MD5Digest> digests;
+    vector<size_t> hits;
     while (!hash_thread_should_exit) {
-        vector<string> local_guesses;
+        local_guesses.clear();
         
         // 从待处理队列中取出猜测进行哈希
         {
             lock_guard<mutex> lock(guesses_mutex);
             if (!pending_hash_guesses.empty()) {
-                local_guesses = move(pending_hash_guesses);
-                pending_hash_guesses.clear();
+                swap(local_guesses, pending_hash_guesses);
             }
         }
         
         // 进行MD5哈希计算
         if (!local_guesses.empty()) {
-            bit32 state[4];
-            for (const string& pw : local_guesses) {
-                if (test_set.find(pw) != test_set.end()) {
-                    total_cracked++;
+            size_t n = local_guesses.size();
+            ptrs.resize(n);
+            lens.resize(n);
+            digests.resize(n);
+            for (size_t i = 0; i < n; i++) {
+                if (targets == nullptr) {
+                    pw.assign(local_guesses.data(i), local_guesses.length(i));
+                    if (test_set.find(pw) != test_set.end()) {
+                        total_cracked++;
+                    }
+                }
+                ptrs[i] = (const uint8_t *)local_guesses.data(i);
+                lens[i] = local_guesses.length(i);
+            }
+            if (small_targets != nullptr) {
+                hits.clear();
+                MD5Match_Batch(ptrs.data(), lens.data(), n, *small_targets, hits);
+                total_cracked += hits.size();
+            } else {
+                MD5Hash_Batch(ptrs.data(), lens.data(), n, digests.data());
+                if (targets != nullptr) {
+                    hits.clear();
+                    targets->find(digests.data(), n, hits);
+                    total_cracked += hits.size();
                 }
-                MD5Hash(pw, state);
-                total_hashed++;  // 统计实际处理的密码数量
             }
+            total_hashed += n;  // 统计实际处理的密码数量
         } else {
             // 没有工作时短暂休眠
             this_thread::sleep_for(chrono::milliseconds(1));
@@ -80,45 +111,144 @@ int main(int argc, char** argv)
     
     auto start_train = system_clock::now();
     
-    // 只在主进程中进行训练
+    // 只有主进程接触训练集：优先mmap已经保存的模型文件，文件不存在或者不是由当前训练集训练得到时才重新训练，并保存模型供下次运行使用
+    string train_path = "/guessdata/Rockyou-singleLined-full.txt";
+    bool cached = false;
     if (rank == 0) {
-        q.m.train("/guessdata/Rockyou-singleLined-full.txt");
-        q.m.order();
+        cached = q.m.load_mapped("./model.map", train_path);
+        if (!cached) {
+            q.m.train(train_path, omp_get_max_threads());
+            q.m.order();
+            q.m.store_mapped("./model.map", train_path);
+        }
     }
+    MPI_Bcast(&cached, 1, MPI_CXX_BOOL, 0, MPI_COMM_WORLD);
     
-    // 简化：所有进程都进行训练（实际应该广播模型数据）
-    if (rank != 0) {
-        q.m.train("/guessdata/Rockyou-singleLined-full.txt");
-        q.m.order();
-    }
+    // 主进程把序列化的模型广播给其余进程，其余进程不再各自训练
+    // 先同步一次，使统计的广播时间不包含其余进程等待主进程训练的时间
+    MPI_Barrier(MPI_COMM_WORLD);
+    double time_bcast = q.BroadcastModel(0);
+    double max_time_bcast = 0;
+    MPI_Reduce(&time_bcast, &max_time_bcast, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
     
     auto end_train = system_clock::now();
     auto duration_train = duration_cast<microseconds>(end_train - start_train);
     time_train = double(duration_train.count()) * microseconds::period::num / microseconds::period::den;
 
-    // 加载测试数据
-    unordered_set<std::string> test_set;
-    ifstream test_data("/guessdata/Rockyou-singleLined-full.txt");
-    int test_count=0;
-    string pw;
-    while(test_data>>pw)
-    {   
-        test_count+=1;
-        test_set.insert(pw);
-        if (test_count>=1000000)
-        {
-            break;
+    // 给出哈希列表文件时改为破解其中的MD5：主进程mmap读取并建立索引，再把排序后的目标广播给其余进程
+    string hashlist = argc > 1 ? argv[1] : "";
+    MD5TargetSet targets;
+    if (!hashlist.empty()) {
+        string target_buf;
+        int loaded = 1;
+        size_t skipped = 0;
+        if (rank == 0) {
+            loaded = targets.load(hashlist, &skipped);
+            targets.serialize(target_buf);
+        }
+        long long target_count = targets.size();
+        MPI_Bcast(&loaded, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        MPI_Bcast(&target_count, 1, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+        if (!loaded) {
+            if (rank == 0) {
+                if (skipped == 0) {
+                    cout << "Cannot open hash list " << hashlist << endl;
+                } else {
+                    cout << "No MD5 hashes in " << hashlist << ": none of its " << skipped
+                         << " non-empty lines starts with a 32-character hex digest" << endl;
+                }
+            }
+            MPI_Finalize();
+            return 1;
+        }
+        BroadcastBuffer(target_buf, 0);
+        // 其余进程必须得到与主进程完全相同的目标，否则各进程破解的是不同的列表
+        if (rank != 0 && (!targets.deserialize(target_buf.data(), target_buf.size()) || (long long)targets.size() != target_count)) {
+            cout << "Rank " << rank << ": failed to deserialize the broadcast hash list" << endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
         }
+        if (rank == 0) {
+            cout << "Loaded " << targets.size() << " target hashes from " << hashlist;
+            if (skipped > 0) {
+                cout << " (skipped " << skipped << " lines that are not MD5 hashes)";
+            }
+            cout << endl;
+        }
+    }
+    MD5SmallTargetSet small_targets;
+    bool use_small = !targets.empty() && targets.size() <= MD5_SMALL_TARGETS_MAX;
+    if (use_small) {
+        MD5Digest digests[MD5_SMALL_TARGETS_MAX];
+        for (size_t i = 0; i < targets.size(); i++) {
+            digests[i] = targets.at(i);
+        }
+        small_targets.assign(digests, targets.size());
+    }
+
+    // 加载测试数据：同样只由主进程读取，再广播给其余进程（破解哈希列表时不需要）
+    string test_buf;
+    if (rank == 0 && hashlist.empty()) {
+        ifstream test_data("/guessdata/Rockyou-singleLined-full.txt");
+        int test_count=0;
+        string pw;
+        while(test_data>>pw)
+        {   
+            test_count+=1;
+            test_buf += pw;
+            test_buf += '\n';
+            if (test_count>=1000000)
+            {
+                break;
+            }
+        }
+    }
+    BroadcastBuffer(test_buf, 0);
+    unordered_set<std::string> test_set;
+    for (size_t begin = 0, end; begin < test_buf.size(); begin = end + 1) {
+        end = test_buf.find('\n', begin);
+        test_set.emplace(test_buf, begin, end - begin);
     }
     
+    auto start_init = system_clock::now();
     q.init();
+    // 启动时间：各进程从开始准备模型到可以生成第一个猜测（模型就绪并完成队列初始化）的时间，取各进程的最大值
+    double time_startup = time_train + duration_cast<microseconds>(system_clock::now() - start_init).count() / 1e6;
+    double max_time_startup = 0;
+    MPI_Reduce(&time_startup, &max_time_startup, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (cached) {
+        // 主进程只是映射了保存的模型，没有训练，与“每个进程都训练”比较没有意义
+        if (rank == 0) {
+            cout << "Startup to first guess on " << size << " ranks: " << max_time_startup
+                 << " s (cache hit: rank 0 loaded ./model.map, broadcast " << max_time_bcast << " s)" << endl;
+        }
+    } else {
+        // 实际测量原来的做法（每个进程各自训练）所需的启动时间，与上面的时间比较
+        // 训练集此时已经在page cache中，原来的做法读取训练集会更快，因此测得的节省偏保守
+        MPI_Barrier(MPI_COMM_WORLD);
+        auto start_old = system_clock::now();
+        {
+            PriorityQueue old_q;
+            old_q.m.train(train_path, omp_get_max_threads());
+            old_q.m.order();
+            old_q.init();
+        }
+        double time_old = duration_cast<microseconds>(system_clock::now() - start_old).count() / 1e6;
+        double max_time_old = 0;
+        MPI_Reduce(&time_old, &max_time_old, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+        if (rank == 0) {
+            cout << "Startup to first guess on " << size << " ranks (max over ranks): every rank trains "
+                 << max_time_old << " s; rank 0 trains and broadcasts " << max_time_startup
+                 << " s (broadcast " << max_time_bcast << " s); saved " << max_time_old - max_time_startup << " s" << endl;
+        }
+    }
     if (rank == 0) {
         cout << "Starting PT-level parallel processing with overlapped computation..." << endl;
         cout << "Termination condition: 10,000,000 passwords HASHED (not just generated)" << endl;
     }
     
     // 启动哈希计算线程
-    thread hash_thread(hash_worker_thread, ref(test_set), ref(time_hash));
+    thread hash_thread(hash_worker_thread, ref(test_set), hashlist.empty() ? nullptr : &targets,
+                       use_small ? &small_targets : nullptr, ref(time_hash));
     
     int global_curr_num = 0;  
     auto start = system_clock::now();
@@ -154,8 +284,7 @@ int main(int argc, char** argv)
         // 将新生成的猜测添加到哈希队列（重叠计算的关键）
         if (!q.guesses.empty()) {
             lock_guard<mutex> lock(guesses_mutex);
-            pending_hash_guesses.insert(pending_hash_guesses.end(), 
-                                      q.guesses.begin(), q.guesses.end());
+            pending_hash_guesses.append(q.guesses);
         }
         
         // 收集所有进程的猜测数量（用于显示生成进度）
@@ -230,7 +359,7 @@ int main(int argc, char** argv)
                 cout << "Total passwords cracked: " << total_cracked_final << endl;
                 cout << "Guess time: " << time_guess - time_hash << " seconds" << endl;
                 cout << "Hash time: " << time_hash << " seconds" << endl;
-                cout << "Train time: " << time_train << " seconds" << endl;
+                cout << "Train time: " << time_train << " seconds" << (cached ? " (loaded cached ./model.map, not trained)" : "") << endl;
                 cout << "Crack rate: " << (double)total_cracked_final / final_global_hashed * 100 << "%" << endl;
             }
             
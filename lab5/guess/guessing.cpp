@@ -1,8 +1,11 @@
 #include "PCFG.h"
+#include "md5.h"
 #include <algorithm>
+#include <cmath>
+#include <thread>
 using namespace std;
 
-void PriorityQueue::CalProb(PT &pt)
+void PriorityQueue::CalProb(PTRecord &pt) const
 {
     // 计算PriorityQueue里面一个PT的流程如下：
     // 1. 首先需要计算一个PT本身的概率。例如，L6S1的概率为0.15
@@ -11,294 +14,755 @@ void PriorityQueue::CalProb(PT &pt)
     // 4. 这个时候就需要计算123456在L6中出现的概率了。假设123456在所有L6 segment中的概率为0.1，那么123456S1的概率就是0.1*0.15
 
     // 计算一个PT本身的概率。后续所有具体segment value的概率，直接累乘在这个初始概率值上
-    pt.prob = pt.preterm_prob;
+    const PTTemplate &t = templates[pt.tmpl];
+    pt.prob = t.preterm_prob;
 
     // index: 标注当前segment在PT中的位置
-    int index = 0;
-
-
-    for (int idx : pt.curr_indices)
+    // 最后一个segment还没有被实例化，按照下标0计算（与最初的实现保持一致）
+    const int *indices = pt.indices();
+    for (int index = 0; index <= pt.n; index += 1)
     {
-        // pt.content[index].PrintSeg();
-        if (pt.content[index].type == 1)
-        {
-            // 下面这行代码的意义：
-            // pt.content[index]：目前需要计算概率的segment
-            // m.FindLetter(seg): 找到一个letter segment在模型中的对应下标
-            // m.letters[m.FindLetter(seg)]：一个letter segment在模型中对应的所有统计数据
-            // m.letters[m.FindLetter(seg)].ordered_values：一个letter segment在模型中，所有value的总数目
-            pt.prob *= m.letters[m.FindLetter(pt.content[index])].ordered_freqs[idx];
-            pt.prob /= m.letters[m.FindLetter(pt.content[index])].total_freq;
-            // cout << m.letters[m.FindLetter(pt.content[index])].ordered_freqs[idx] << endl;
-            // cout << m.letters[m.FindLetter(pt.content[index])].total_freq << endl;
-        }
-        if (pt.content[index].type == 2)
-        {
-            pt.prob *= m.digits[m.FindDigit(pt.content[index])].ordered_freqs[idx];
-            pt.prob /= m.digits[m.FindDigit(pt.content[index])].total_freq;
-            // cout << m.digits[m.FindDigit(pt.content[index])].ordered_freqs[idx] << endl;
-            // cout << m.digits[m.FindDigit(pt.content[index])].total_freq << endl;
-        }
-        if (pt.content[index].type == 3)
-        {
-            pt.prob *= m.symbols[m.FindSymbol(pt.content[index])].ordered_freqs[idx];
-            pt.prob /= m.symbols[m.FindSymbol(pt.content[index])].total_freq;
-            // cout << m.symbols[m.FindSymbol(pt.content[index])].ordered_freqs[idx] << endl;
-            // cout << m.symbols[m.FindSymbol(pt.content[index])].total_freq << endl;
-        }
-        index += 1;
+        // 下面这行代码的意义：
+        // t.segs[index]：目前需要计算概率的segment在模型中对应的所有统计数据（构建模板时已经定位好，不需要再查找）
+        // m.ProbAt：每个value在segment中的概率，在order()时预先算好，这里只需要乘法
+        pt.prob *= m.ProbAt(*t.segs[index], index < pt.n ? indices[index] : 0);
     }
     // cout << pt.prob << endl;
 }
 
+float PriorityQueue::ChildProb(const PTRecord &pt, int i) const
+{
+    // 新PT只有第i个下标比pt大1。它的概率按照与CalProb完全相同的顺序做乘法，
+    // 因此只取决于新PT本身，与它由哪个父PT、哪种规则生成无关，和CalProb的结果也逐位相同
+    // 各value的概率在order()时已经预先算好，这里只需要n+1次乘法
+    const PTTemplate &t = templates[pt.tmpl];
+    const int *indices = pt.indices();
+    float prob = t.preterm_prob;
+    for (int index = 0; index <= pt.n; index += 1)
+    {
+        int value = index < pt.n ? indices[index] + (index == i) : 0;
+        prob *= m.ProbAt(*t.segs[index], value);
+    }
+    return prob;
+}
+
 void PriorityQueue::init()
 {
     // cout << m.ordered_pts.size() << endl;
-    // 用所有可能的PT，按概率降序填满整个优先队列
-    for (PT pt : m.ordered_pts)
+    // ordered_pts中的PT按照下标预留序号，之后新产生的PT的序号都排在它们后面
+    priority.next_seq = m.ordered_pts.size();
+    next_seed = 0;
+    templates.clear();
+    templates.reserve(m.ordered_pts.size());
+    Seed();
+    // cout << "priority size:" << priority.size() << endl;
+}
+
+void PriorityQueue::SeedNext()
+{
+    // 序号即为PT在ordered_pts中的下标
+    unsigned long long seq = next_seed;
+    priority.push(MakeSeed(), seq);
+}
+
+PTRecord PriorityQueue::MakeSeed()
+{
+    const PT &base = m.ordered_pts[next_seed];
+    PTTemplate t;
+    for (const segment &seg : base.content)
+    {
+        // 下面这行代码的意义：
+        // max_indices用来表示PT中各个segment的可能数目。例如，L6S1中，假设模型统计到了100个L6，那么L6对应的最大下标就是99
+        // （但由于后面采用了"<"的比较关系，所以其实max_indices[0]=100）
+        // m.GetSegment(seg)：一个segment在模型中对应的所有统计数据
+        // m.GetSegment(seg).value_count：一个segment在模型中，所有value的总数目
+        t.segs.emplace_back(&m.GetSegment(seg));
+        t.max_indices.emplace_back(t.segs.back()->value_count);
+    }
+    // preterm_prob在order/load时已经按照 preterm_freq / total_preterm 计算好
+    t.preterm_prob = base.preterm_prob;
+    templates.emplace_back(std::move(t));
+
+    // 各下标都为0的PT，模板编号与其在ordered_pts中的下标相同
+    PTRecord pt(next_seed, base.content.size() - 1);
+    // 计算当前pt的概率
+    CalProb(pt);
+    next_seed += 1;
+    return pt;
+}
+
+void PriorityQueue::Seed()
+{
+    // 实例化后的概率是preterm_prob连乘若干个不超过1的概率，舍入是单调的，所以不会超过preterm_prob
+    // 这里仍然留出1e-5的相对余量，比较的方式改变时也不会漏掉PT
+    while (next_seed < m.ordered_pts.size() && priority.MayPrecede(m.ordered_pts[next_seed].preterm_prob * 1.00001f))
+    {
+        SeedNext();
+    }
+}
+
+void PriorityQueue::PopNext()
+{
+    // 将优先队列最前面的PT出队
+    PTRecord pt = priority.pop();
+
+    // 首先利用这个PT生成一系列猜测
+    GenerateMPI(pt);
+
+    // 然后需要根据出队的PT，生成一系列新的PT，计算概率后放入优先队列
+    PushNewPTs(pt);
+}
+
+void PriorityQueue::PopNextHash(vector<unsigned int> &digests)
+{
+    PTRecord pt = priority.pop();
+    size_t before = digests.size();
+    GenerateHash(pt, digests);
+    total_guesses += (digests.size() - before) / 4;
+    PushNewPTs(pt);
+}
+
+void PriorityQueue::PushNewPTs(PTRecord &pt)
+{
+    new_pts.clear();
+    NewPTs(pt, new_pts);
+    for (PTRecord &new_pt : new_pts)
+    {
+        priority.push(std::move(new_pt));
+    }
+    Seed();
+}
+
+// 这个函数你就算看不懂，对并行算法的实现影响也不大
+// 当然如果你想做一个基于多优先队列的并行算法，可能得稍微看一看了
+void PriorityQueue::NewPTs(PTRecord &pt, vector<PTRecord> &out) const
+{
+    const PTTemplate &t = templates[pt.tmpl];
+    int *indices = pt.indices();
+    if (!deadbeat)
     {
-        for (segment seg : pt.content)
+        // pivot规则
+        // 假如这个PT只有一个segment（n为0），那么这个segment的所有value在出队前就已经被遍历完毕，并作为猜测输出
+        // 因此，所有这个PT可能对应的口令猜测已经遍历完成，无需生成新的PT
+
+        // 开始遍历所有位置值大于等于pivot值的segment，我们将更改这些segment的值，并且一次只更改一个segment
+        // 注意i < n，也就是除去了最后一个segment（这个segment的赋值预留给并行环节）
+        for (int i = pt.pivot; i < pt.n; i += 1)
         {
-            if (seg.type == 1)
+            // indices: 标记各segment目前的value在模型里对应的下标
+            // max_indices：标记各segment在模型中一共有多少个value
+            if (indices[i] + 1 < t.max_indices[i])
             {
-                // 下面这行代码的意义：
-                // max_indices用来表示PT中各个segment的可能数目。例如，L6S1中，假设模型统计到了100个L6，那么L6对应的最大下标就是99
-                // （但由于后面采用了"<"的比较关系，所以其实max_indices[0]=100）
-                // m.FindLetter(seg): 找到一个letter segment在模型中的对应下标
-                // m.letters[m.FindLetter(seg)]：一个letter segment在模型中对应的所有统计数据
-                // m.letters[m.FindLetter(seg)].ordered_values：一个letter segment在模型中，所有value的总数目
-                pt.max_indices.emplace_back(m.letters[m.FindLetter(seg)].ordered_values.size());
+                // 新PT的第i个下标加1，pivot值更新为i
+                // 这个步骤对于你理解pivot的作用、新PT生成的过程而言，至关重要
+                out.emplace_back(pt);
+                PTRecord &child = out.back();
+                child.pivot = i;
+                child.prob = ChildProb(pt, i);
+                child.indices()[i] += 1;
             }
-            if (seg.type == 2)
+        }
+        return;
+    }
+
+    // deadbeat dad规则：与pivot规则一样，只改变最后一个segment以外的下标
+    // 负责入队的父PT必须只由新PT本身决定，所以比较时各父PT的概率都用CalProb计算
+    // 队列中每个PT的概率都与CalProb的结果相同，pt.prob可以直接作为父PT i的概率
+    float prob = pt.prob;
+    for (int i = 0; i < pt.n; i += 1)
+    {
+        if (indices[i] + 1 >= t.max_indices[i])
+        {
+            continue;
+        }
+        // 就地把pt变成这个新PT，依次计算它的每个父PT的概率，找出负责入队的父PT
+        // 这只取决于新PT本身，因此无论从哪个父PT出发，得到的结果都相同，每个PT恰好入队一次
+        // 负责入队的父PT的概率不低于新PT，新PT一定会在轮到它出队之前入队
+        indices[i] += 1;
+        int owner = i;
+        float owner_prob = prob;
+        for (int j = 0; j < pt.n; j += 1)
+        {
+            if (j == i || indices[j] == 0)
             {
-                pt.max_indices.emplace_back(m.digits[m.FindDigit(seg)].ordered_values.size());
+                continue;
             }
-            if (seg.type == 3)
+            indices[j] -= 1;
+            CalProb(pt);
+            indices[j] += 1;
+            if (pt.prob < owner_prob || (pt.prob == owner_prob && j < owner))
             {
-                pt.max_indices.emplace_back(m.symbols[m.FindSymbol(seg)].ordered_values.size());
+                owner = j;
+                owner_prob = pt.prob;
             }
         }
-        pt.preterm_prob = float(m.preterm_freq[m.FindPT(pt)]) / m.total_preterm;
-        // pt.PrintPT();
-        // cout << " " << m.preterm_freq[m.FindPT(pt)] << " " << m.total_preterm << " " << pt.preterm_prob << endl;
-
-        // 计算当前pt的概率
-        CalProb(pt);
-        // 将PT放入优先队列
-        priority.emplace_back(pt);
+        indices[i] -= 1;
+        if (owner == i)
+        {
+            pt.prob = prob;
+            out.emplace_back(pt);
+            PTRecord &child = out.back();
+            child.prob = ChildProb(pt, i);
+            child.indices()[i] += 1;
+        }
     }
-    // cout << "priority size:" << priority.size() << endl;
+    pt.prob = prob;
 }
 
-void PriorityQueue::PopNext()
+void PTHeap::push(const PTEntry &e)
 {
+    heap.push_back(e);
+    sift_up(heap.size() - 1);
+}
 
-    // 对优先队列最前面的PT，首先利用这个PT生成一系列猜测
-    GenerateMPI(priority.front());
+PTEntry PTHeap::pop()
+{
+    PTEntry e = heap[0];
+    heap[0] = heap.back();
+    heap.pop_back();
+    if (!heap.empty())
+    {
+        sift_down(0);
+    }
+    return e;
+}
 
-    // 然后需要根据即将出队的PT，生成一系列新的PT
-    vector<PT> new_pts = priority.front().NewPTs();
-    for (PT pt : new_pts)
+void PTHeap::sift_up(size_t i)
+{
+    PTEntry e = heap[i];
+    while (i > 0)
     {
-        // 计算概率
-        CalProb(pt);
-        // 接下来的这个循环，作用是根据概率，将新的PT插入到优先队列中
-        for (auto iter = priority.begin(); iter != priority.end(); iter++)
+        size_t parent = (i - 1) / D;
+        if (!before(e, heap[parent]))
         {
-            // 对于非队首和队尾的特殊情况
-            if (iter != priority.end() - 1 && iter != priority.begin())
-            {
-                // 判定概率
-                if (pt.prob <= iter->prob && pt.prob > (iter + 1)->prob)
-                {
-                    priority.emplace(iter + 1, pt);
-                    break;
-                }
-            }
-            if (iter == priority.end() - 1)
+            break;
+        }
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = e;
+}
+
+void PTHeap::sift_down(size_t i)
+{
+    PTEntry e = heap[i];
+    size_t n = heap.size();
+    while (true)
+    {
+        // D个子节点在数组中是连续的，一次比较只需要访问一到两条cache line
+        size_t first = i * D + 1;
+        if (first >= n)
+        {
+            break;
+        }
+        size_t last = min(first + D, n);
+        size_t best = first;
+        for (size_t c = first + 1; c < last; c += 1)
+        {
+            if (before(heap[c], heap[best]))
             {
-                priority.emplace_back(pt);
-                break;
+                best = c;
             }
-            if (iter == priority.begin() && iter->prob < pt.prob)
+        }
+        if (!before(heap[best], e))
+        {
+            break;
+        }
+        heap[i] = heap[best];
+        i = best;
+    }
+    heap[i] = e;
+}
+
+size_t PTBucketQueue::BucketOf(float prob) const
+{
+    // 概率为0（或下溢）的PT统一放入最后一个桶
+    const size_t max_bucket = 160 * per_octave;
+    if (!(prob > 0))
+    {
+        return max_bucket;
+    }
+    double b = -log2((double)prob) * per_octave;
+    if (b < 0)
+    {
+        return 0;
+    }
+    return min((size_t)b, max_bucket);
+}
+
+void PTBucketQueue::push(const PTEntry &e)
+{
+    size_t b = BucketOf(e.prob);
+    if (b >= buckets.size())
+    {
+        buckets.resize(b + 1);
+        heads.resize(b + 1, 0);
+    }
+    buckets[b].push_back(e);
+    // 新PT的概率一般不高于刚出队的父PT，所以cursor几乎只会单调后移
+    if (count == 0 || b < cursor)
+    {
+        cursor = b;
+    }
+    count += 1;
+}
+
+PTEntry PTBucketQueue::pop()
+{
+    while (heads[cursor] == buckets[cursor].size())
+    {
+        cursor += 1;
+    }
+    PTEntry e = buckets[cursor][heads[cursor]];
+    heads[cursor] += 1;
+    // 桶被取空时释放其中的记录，之后可以重新使用
+    if (heads[cursor] == buckets[cursor].size())
+    {
+        buckets[cursor].clear();
+        heads[cursor] = 0;
+    }
+    count -= 1;
+    return e;
+}
+
+void PTQueue::UseBuckets(int per_octave)
+{
+    use_buckets = true;
+    buckets.per_octave = per_octave;
+}
+
+void PTQueue::push(PTRecord &&pt, unsigned long long seq)
+{
+    // PT放入一个空闲槽位，后端只记录槽位号
+    unsigned int slot;
+    if (free_slots.empty())
+    {
+        slot = slots.size();
+        slots.emplace_back(std::move(pt));
+    }
+    else
+    {
+        slot = free_slots.back();
+        free_slots.pop_back();
+        slots[slot] = std::move(pt);
+    }
+    PTEntry e{slots[slot].prob, slot, seq};
+    if (use_buckets)
+    {
+        buckets.push(e);
+    }
+    else
+    {
+        heap.push(e);
+    }
+}
+
+bool PTQueue::MayPrecede(float prob) const
+{
+    if (empty())
+    {
+        return true;
+    }
+    if (!use_buckets)
+    {
+        return prob >= heap.heap[0].prob;
+    }
+    // 分桶后端：不晚于第一个非空桶即可
+    size_t b = buckets.cursor;
+    while (buckets.heads[b] == buckets.buckets[b].size())
+    {
+        b += 1;
+    }
+    return buckets.BucketOf(prob) <= b;
+}
+
+PTRecord PTQueue::pop()
+{
+    PTEntry e;
+    if (use_buckets)
+    {
+        e = buckets.pop();
+        if (track_fidelity)
+        {
+            // 出队之后cursor仍然指向刚才的桶（或者该桶已空），桶内剩余元素中的最大概率就是真正的最大概率
+            float best = e.prob;
+            const vector<PTEntry> &bucket = buckets.buckets[buckets.cursor];
+            for (size_t i = buckets.heads[buckets.cursor]; i < bucket.size(); i += 1)
             {
-                priority.emplace(iter, pt);
-                break;
+                best = max(best, bucket[i].prob);
             }
+            double ratio = e.prob > 0 ? double(best) / e.prob : 1;
+            pops += 1;
+            out_of_order += best > e.prob;
+            worst_ratio = max(worst_ratio, ratio);
+            sum_ratio += ratio;
         }
     }
+    else
+    {
+        e = heap.pop();
+    }
+    PTRecord pt = std::move(slots[e.slot]);
+    free_slots.emplace_back(e.slot);
+    return pt;
+}
+
+void PTQueue::PrintFidelity()
+{
+    if (!use_buckets || pops == 0)
+    {
+        cout << "Queue fidelity: exact order (heap backend)" << endl;
+        return;
+    }
+    cout << "Queue fidelity (" << buckets.per_octave << " buckets per octave, bound "
+         << pow(2.0, 1.0 / buckets.per_octave) << "x): "
+         << out_of_order << "/" << pops << " pops out of order ("
+         << 100.0 * out_of_order / pops << "%), worst prob ratio " << worst_ratio
+         << ", mean prob ratio " << sum_ratio / pops << endl;
+}
 
-    // 现在队首的PT善后工作已经结束，将其出队（删除）
-    priority.erase(priority.begin());
+PTMultiQueue::PTMultiQueue(int n_threads, int queues_per_thread)
+{
+    n_queues = max(2, n_threads * queues_per_thread);
+    queues.reset(new SubQueue[n_queues]);
 }
 
-// 这个函数你就算看不懂，对并行算法的实现影响也不大
-// 当然如果你想做一个基于多优先队列的并行算法，可能得稍微看一看了
-vector<PT> PT::NewPTs()
+unsigned int PTMultiQueue::Random()
 {
-    // 存储生成的新PT
-    vector<PT> res;
+    // 每个线程独立的xorshift随机数，避免共享随机数状态
+    static thread_local unsigned int state = 2463534242u ^ (unsigned int)hash<thread::id>()(this_thread::get_id());
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+void PTMultiQueue::Lock(SubQueue &q)
+{
+    while (q.lock.test_and_set(memory_order_acquire))
+    {
+        this_thread::yield();
+    }
+}
 
-    // 假如这个PT只有一个segment
-    // 那么这个segment的所有value在出队前就已经被遍历完毕，并作为猜测输出
-    // 因此，所有这个PT可能对应的口令猜测已经遍历完成，无需生成新的PT
-    if (content.size() == 1)
+void PTMultiQueue::Unlock(SubQueue &q)
+{
+    q.lock.clear(memory_order_release);
+}
+
+void PTMultiQueue::push(PTRecord &&pt)
+{
+    // 随机选择一个子堆，被占用时换一个，避免在同一把锁上等待
+    SubQueue *q = &queues[Random() % n_queues];
+    while (q->lock.test_and_set(memory_order_acquire))
     {
-        return res;
+        q = &queues[Random() % n_queues];
+    }
+    unsigned int slot;
+    if (q->free_slots.empty())
+    {
+        slot = q->slots.size();
+        q->slots.emplace_back(std::move(pt));
     }
     else
     {
-        // 最初的pivot值。我们将更改位置下标大于等于这个pivot值的segment的值（最后一个segment除外），并且一次只更改一个segment
-        // 上面这句话里是不是有没看懂的地方？接着往下看你应该会更明白
-        int init_pivot = pivot;
+        slot = q->free_slots.back();
+        q->free_slots.pop_back();
+        q->slots[slot] = std::move(pt);
+    }
+    q->heap.push(PTEntry{q->slots[slot].prob, slot, q->next_seq++});
+    q->top_prob.store(q->heap.heap[0].prob, memory_order_relaxed);
+    count.fetch_add(1);
+    Unlock(*q);
+}
+
+float PTMultiQueue::TopProb() const
+{
+    float top = -1;
+    for (int i = 0; i < n_queues; i += 1)
+    {
+        top = max(top, queues[i].top_prob.load(memory_order_relaxed));
+    }
+    return top;
+}
 
-        // 开始遍历所有位置值大于等于init_pivot值的segment
-        // 注意i < curr_indices.size() - 1，也就是除去了最后一个segment（这个segment的赋值预留给并行环节）
-        for (int i = pivot; i < curr_indices.size() - 1; i += 1)
+bool PTMultiQueue::try_pop(PTRecord &pt)
+{
+    while (count.load() > 0)
+    {
+        // two-choice：随机取两个子堆，从队首概率较高的子堆出队
+        SubQueue &a = queues[Random() % n_queues];
+        SubQueue &b = queues[Random() % n_queues];
+        SubQueue &q = a.top_prob.load(memory_order_relaxed) >= b.top_prob.load(memory_order_relaxed) ? a : b;
+        if (q.top_prob.load(memory_order_relaxed) < 0 || q.lock.test_and_set(memory_order_acquire))
+        {
+            continue;
+        }
+        if (q.heap.empty())
         {
-            // curr_indices: 标记各segment目前的value在模型里对应的下标
-            curr_indices[i] += 1;
+            Unlock(q);
+            continue;
+        }
+        PTEntry e = q.heap.pop();
+        pt = std::move(q.slots[e.slot]);
+        q.free_slots.emplace_back(e.slot);
+        q.top_prob.store(q.heap.empty() ? -1 : q.heap.heap[0].prob, memory_order_relaxed);
+        count.fetch_sub(1);
+        Unlock(q);
 
-            // max_indices：标记各segment在模型中一共有多少个value
-            if (curr_indices[i] < max_indices[i])
+        if (track_rank_error)
+        {
+            long long error = 0;
+            for (int i = 0; i < n_queues; i += 1)
+            {
+                error += queues[i].top_prob.load(memory_order_relaxed) > e.prob;
+            }
+            pops.fetch_add(1, memory_order_relaxed);
+            rank_error_sum.fetch_add(error, memory_order_relaxed);
+            long long curr_max = rank_error_max.load(memory_order_relaxed);
+            while (error > curr_max && !rank_error_max.compare_exchange_weak(curr_max, error))
             {
-                // 更新pivot值
-                pivot = i;
-                res.emplace_back(*this);
             }
-
-            // 这个步骤对于你理解pivot的作用、新PT生成的过程而言，至关重要
-            curr_indices[i] -= 1;
         }
-        pivot = init_pivot;
-        return res;
+        return true;
     }
-
-    return res;
+    return false;
 }
 
-
-// 这个函数是PCFG并行化算法的主要载体
-// 尽量看懂，然后进行并行实现
-void PriorityQueue::Generate(PT pt)
+long long PriorityQueue::PopParallel(PTMultiQueue &mq, int n_threads, long long max_guesses,
+                                     const function<void(GuessBuffer &)> &consume, size_t batch_size)
 {
-    // 计算PT的概率，这里主要是给PT的概率进行初始化
-    CalProb(pt);
+    while (!priority.empty())
+    {
+        mq.push(priority.pop());
+    }
 
-    // 对于只有一个segment的PT，直接遍历生成其中的所有value即可
-    if (pt.content.size() == 1)
+    // 与Seed相同的惰性初始化：抢到seed_lock的线程把ordered_pts中可能先于mq队首出队的PT实例化并入队
+    // mq的队首概率在并发时只是近似值，但MultiQueue本身就是近似有序的；所有PT都入队之后seeded才为true
+    // templates在init时已经按照ordered_pts的大小预留了空间，追加模板不会移动其他线程正在读取的模板
+    atomic_flag seed_lock = ATOMIC_FLAG_INIT;
+    atomic<bool> seeded{next_seed >= m.ordered_pts.size()};
+    auto seed = [&]()
     {
-        // 指向最后一个segment的指针，这个指针实际指向模型中的统计数据
-        segment *a;
-        // 在模型中定位到这个segment
-        if (pt.content[0].type == 1)
+        if (seeded.load(memory_order_acquire) || seed_lock.test_and_set(memory_order_acquire))
+        {
+            return;
+        }
+        while (next_seed < m.ordered_pts.size() && m.ordered_pts[next_seed].preterm_prob * 1.00001f >= mq.TopProb())
         {
-            a = &m.letters[m.FindLetter(pt.content[0])];
+            mq.push(MakeSeed());
         }
-        if (pt.content[0].type == 2)
+        seeded.store(next_seed >= m.ordered_pts.size(), memory_order_release);
+        seed_lock.clear(memory_order_release);
+    };
+
+    atomic<long long> generated{0};
+    // 正在处理（已出队但新PT尚未入队，或者正在惰性初始化）的线程数目
+    // 队列为空、没有正在处理的线程并且所有PT都已经入队时才能结束
+    atomic<int> in_flight{0};
+    auto worker = [&]()
+    {
+        GuessBuffer local;
+        PTRecord pt;
+        vector<PTRecord> new_pts;
+        while (generated.load(memory_order_relaxed) < max_guesses)
         {
-            a = &m.digits[m.FindDigit(pt.content[0])];
+            in_flight.fetch_add(1);
+            seed();
+            if (!mq.try_pop(pt))
+            {
+                in_flight.fetch_sub(1);
+                if (in_flight.load() == 0 && mq.size() == 0 && seeded.load(memory_order_acquire))
+                {
+                    break;
+                }
+                this_thread::yield();
+                continue;
+            }
+            size_t before = local.size();
+            Generate(pt, local);
+            generated.fetch_add(local.size() - before, memory_order_relaxed);
+            new_pts.clear();
+            NewPTs(pt, new_pts);
+            for (PTRecord &new_pt : new_pts)
+            {
+                mq.push(std::move(new_pt));
+            }
+            in_flight.fetch_sub(1);
+            if (local.size() >= batch_size)
+            {
+                consume(local);
+                local.clear();
+            }
         }
-        if (pt.content[0].type == 3)
+        if (!local.empty())
         {
-            a = &m.symbols[m.FindSymbol(pt.content[0])];
+            consume(local);
         }
+    };
+
+    vector<thread> threads;
+    for (int i = 0; i < n_threads; i += 1)
+    {
+        threads.emplace_back(worker);
+    }
+    for (thread &t : threads)
+    {
+        t.join();
+    }
+
+    // 没有处理的PT放回priority，之后可以继续串行生成（这部分出队不计入rank error统计）
+    bool track = mq.track_rank_error;
+    mq.track_rank_error = false;
+    PTRecord pt;
+    while (mq.try_pop(pt))
+    {
+        priority.push(std::move(pt));
+    }
+    mq.track_rank_error = track;
+    total_guesses += generated.load();
+    return generated.load();
+}
+
+// 这个函数是PCFG并行化算法的主要载体
+// 尽量看懂，然后进行并行实现
+void PriorityQueue::Generate(const PTRecord &pt)
+{
+    size_t before = guesses.size();
+    Generate(pt, guesses);
+    total_guesses += guesses.size() - before;
+}
+
+void PriorityQueue::Generate(const PTRecord &pt, GuessBuffer &out) const
+{
+    // PT的概率在入队时已经计算过，生成猜测时不需要再计算
+
+    // 对于只有一个segment的PT，直接遍历生成其中的所有value即可
+    const PTTemplate &t = templates[pt.tmpl];
+    if (pt.n == 0)
+    {
+        // 指向最后一个segment的指针，这个指针实际指向模型中的统计数据
+        const segment *a = t.segs[0];
         
         // Multi-thread TODO：
         // 这个for循环就是你需要进行并行化的主要部分了，特别是在多线程&GPU编程任务中
         // 可以看到，这个循环本质上就是把模型中一个segment的所有value，赋值到PT中，形成一系列新的猜测
         // 这个过程是可以高度并行化的
-        for (int i = 0; i < pt.max_indices[0]; i += 1)
+        for (int i = 0; i < t.max_indices[0]; i += 1)
         {
-            string guess = a->ordered_values[i];
-            // cout << guess << endl;
-            guesses.emplace_back(guess);
-            total_guesses += 1;
+            // 猜测直接写入out的字节数组，不需要构造string
+            out.push(m.ValueAt(*a, i), a->length);
         }
     }
     else
     {
         string guess;
-        int seg_idx = 0;
+        const int *indices = pt.indices();
         // 这个for循环的作用：给当前PT的所有segment赋予实际的值（最后一个segment除外）
-        // segment值根据curr_indices中对应的值加以确定
+        // segment值根据indices中对应的值加以确定
         // 这个for循环你看不懂也没太大问题，并行算法不涉及这里的加速
-        for (int idx : pt.curr_indices)
+        for (int seg_idx = 0; seg_idx < pt.n; seg_idx += 1)
         {
-            if (pt.content[seg_idx].type == 1)
-            {
-                guess += m.letters[m.FindLetter(pt.content[seg_idx])].ordered_values[idx];
-            }
-            if (pt.content[seg_idx].type == 2)
-            {
-                guess += m.digits[m.FindDigit(pt.content[seg_idx])].ordered_values[idx];
-            }
-            if (pt.content[seg_idx].type == 3)
-            {
-                guess += m.symbols[m.FindSymbol(pt.content[seg_idx])].ordered_values[idx];
-            }
-            seg_idx += 1;
-            if (seg_idx == pt.content.size() - 1)
-            {
-                break;
-            }
+            const segment &seg = *t.segs[seg_idx];
+            guess.append(m.ValueAt(seg, indices[seg_idx]), seg.length);
         }
 
         // 指向最后一个segment的指针，这个指针实际指向模型中的统计数据
-        segment *a;
-        if (pt.content[pt.content.size() - 1].type == 1)
-        {
-            a = &m.letters[m.FindLetter(pt.content[pt.content.size() - 1])];
-        }
-        if (pt.content[pt.content.size() - 1].type == 2)
-        {
-            a = &m.digits[m.FindDigit(pt.content[pt.content.size() - 1])];
-        }
-        if (pt.content[pt.content.size() - 1].type == 3)
-        {
-            a = &m.symbols[m.FindSymbol(pt.content[pt.content.size() - 1])];
-        }
+        const segment *a = t.segs[pt.n];
         
         // Multi-thread TODO：
         // 这个for循环就是你需要进行并行化的主要部分了，特别是在多线程&GPU编程任务中
         // 可以看到，这个循环本质上就是把模型中一个segment的所有value，赋值到PT中，形成一系列新的猜测
         // 这个过程是可以高度并行化的
-        for (int i = 0; i < pt.max_indices[pt.content.size() - 1]; i += 1)
+        for (int i = 0; i < t.max_indices[pt.n]; i += 1)
         {
-            string temp = guess + a->ordered_values[i];
-            // cout << temp << endl;
-            guesses.emplace_back(temp);
-            total_guesses += 1;
+            out.push(guess.data(), guess.length(), m.ValueAt(*a, i), a->length);
         }
     }
 }
 
-void PriorityQueue::GenerateMPI(PT pt)
+void PriorityQueue::GenerateHash(const PTRecord &pt, vector<unsigned int> &digests) const
 {
-    // 计算PT的概率，这里主要是给PT的概率进行初始化
-    CalProb(pt);
+    const PTTemplate &t = templates[pt.tmpl];
+    string prefix;
+    const int *indices = pt.indices();
+    for (int seg_idx = 0; seg_idx < pt.n; seg_idx += 1)
+    {
+        const segment &seg = *t.segs[seg_idx];
+        prefix.append(m.ValueAt(seg, indices[seg_idx]), seg.length);
+    }
+    const segment *a = t.segs[pt.n];
+    size_t length = prefix.length() + a->length;
+    // 填充之后的块数：消息之后至少还要放下0x80和8字节的长度
+    int n_blocks = (length + 8) / 64 + 1;
 
-    // 对于只有一个segment的PT，直接遍历生成其中的所有value即可
-    if (pt.content.size() == 1)
+    // 通道交错的消息缓冲区，每个线程一份，在不同的PT之间复用
+    static thread_local vector<bit32x4_t> words;
+    words.assign(n_blocks * 16, vdupq_n_u32(0));
+    Byte *bytes = (Byte *)words.data();
+    // 前缀对应的MD5中间状态每个PT只算一次，之后每组猜测都从这个状态继续
+    MD5PrefixState prefix_state;
+    MD5PrefixPrecompute(prefix.data(), prefix.length(), prefix_state);
+    // 完全位于前缀中的块已经算进中间状态，不会再被读取，不需要写入
+    size_t skipped = (size_t)prefix_state.full_blocks * 64;
+    // 4个通道的前缀、填充和长度都相同，每个PT只写一次
+    for (int lane = 0; lane < 4; lane += 1)
     {
-        // 指向最后一个segment的指针，这个指针实际指向模型中的统计数据
-        segment *a;
-        // 在模型中定位到这个segment
-        if (pt.content[0].type == 1)
+        for (size_t k = skipped; k < prefix.length(); k += 1)
         {
-            a = &m.letters[m.FindLetter(pt.content[0])];
+            bytes[LaneByteOffset(lane, k)] = prefix[k];
         }
-        if (pt.content[0].type == 2)
+        bytes[LaneByteOffset(lane, length)] = 0x80;
+        for (int i = 0; i < 8; i += 1)
+        {
+            bytes[LaneByteOffset(lane, n_blocks * 64 - 8 + i)] = ((uint64_t)length * 8 >> (i * 8)) & 0xFF;
+        }
+    }
+    // 最后一个segment的各字节在通道0中的偏移，通道l再加上4*l
+    static thread_local vector<size_t> suffix_offsets;
+    suffix_offsets.resize(a->length);
+    for (int k = 0; k < a->length; k += 1)
+    {
+        suffix_offsets[k] = LaneByteOffset(0, prefix.length() + k);
+    }
+
+    int count = t.max_indices[pt.n];
+    size_t base = digests.size();
+    digests.resize(base + (size_t)count * 4);
+    bit32 states[4][4];
+    for (int i = 0; i < count; i += 4)
+    {
+        // 最后不足4个时，多余的通道保留上一组的内容，其结果直接丢弃
+        int lanes = min(4, count - i);
+        for (int lane = 0; lane < lanes; lane += 1)
         {
-            a = &m.digits[m.FindDigit(pt.content[0])];
+            const char *value = m.ValueAt(*a, i + lane);
+            for (int k = 0; k < a->length; k += 1)
+            {
+                bytes[suffix_offsets[k] + lane * 4] = value[k];
+            }
         }
-        if (pt.content[0].type == 3)
+        MD5Hash_SIMD_Blocks(words.data(), n_blocks, states, prefix_state);
+        for (int lane = 0; lane < lanes; lane += 1)
         {
-            a = &m.symbols[m.FindSymbol(pt.content[0])];
+            memcpy(&digests[base + (size_t)(i + lane) * 4], states[lane], sizeof(states[lane]));
         }
+    }
+}
+
+void PriorityQueue::GenerateMPI(const PTRecord &pt)
+{
+    // PT的概率在入队时已经计算过，生成猜测时不需要再计算
+
+    // 对于只有一个segment的PT，直接遍历生成其中的所有value即可
+    const PTTemplate &t = templates[pt.tmpl];
+    if (pt.n == 0)
+    {
+        // 指向最后一个segment的指针，这个指针实际指向模型中的统计数据
+        const segment *a = t.segs[0];
         
         // MPI并行化：将工作分配给不同进程
-        int total_values = pt.max_indices[0];
+        int total_values = t.max_indices[0];
         int values_per_process = total_values / mpi_size;
         int remainder = total_values % mpi_size;
         
@@ -308,54 +772,26 @@ void PriorityQueue::GenerateMPI(PT pt)
         // 每个进程处理自己的部分
         for (int i = start_idx; i < end_idx; i++)
         {
-            string guess = a->ordered_values[i];
-            guesses.emplace_back(guess);
+            guesses.push(m.ValueAt(*a, i), a->length);
             total_guesses += 1;
         }
     }
     else
     {
         string guess;
-        int seg_idx = 0;
+        const int *indices = pt.indices();
         // 这个for循环的作用：给当前PT的所有segment赋予实际的值（最后一个segment除外）
-        for (int idx : pt.curr_indices)
+        for (int seg_idx = 0; seg_idx < pt.n; seg_idx += 1)
         {
-            if (pt.content[seg_idx].type == 1)
-            {
-                guess += m.letters[m.FindLetter(pt.content[seg_idx])].ordered_values[idx];
-            }
-            if (pt.content[seg_idx].type == 2)
-            {
-                guess += m.digits[m.FindDigit(pt.content[seg_idx])].ordered_values[idx];
-            }
-            if (pt.content[seg_idx].type == 3)
-            {
-                guess += m.symbols[m.FindSymbol(pt.content[seg_idx])].ordered_values[idx];
-            }
-            seg_idx += 1;
-            if (seg_idx == pt.content.size() - 1)
-            {
-                break;
-            }
+            const segment &seg = *t.segs[seg_idx];
+            guess.append(m.ValueAt(seg, indices[seg_idx]), seg.length);
         }
 
         // 指向最后一个segment的指针
-        segment *a;
-        if (pt.content[pt.content.size() - 1].type == 1)
-        {
-            a = &m.letters[m.FindLetter(pt.content[pt.content.size() - 1])];
-        }
-        if (pt.content[pt.content.size() - 1].type == 2)
-        {
-            a = &m.digits[m.FindDigit(pt.content[pt.content.size() - 1])];
-        }
-        if (pt.content[pt.content.size() - 1].type == 3)
-        {
-            a = &m.symbols[m.FindSymbol(pt.content[pt.content.size() - 1])];
-        }
+        const segment *a = t.segs[pt.n];
         
         // MPI并行化：将工作分配给不同进程
-        int total_values = pt.max_indices[pt.content.size() - 1];
+        int total_values = t.max_indices[pt.n];
         int values_per_process = total_values / mpi_size;
         int remainder = total_values % mpi_size;
         
@@ -365,8 +801,7 @@ void PriorityQueue::GenerateMPI(PT pt)
         // 每个进程处理自己的部分
         for (int i = start_idx; i < end_idx; i++)
         {
-            string temp = guess + a->ordered_values[i];
-            guesses.emplace_back(temp);
+            guesses.push(guess.data(), guess.length(), m.ValueAt(*a, i), a->length);
             total_guesses += 1;
         }
     }
@@ -374,137 +809,101 @@ void PriorityQueue::GenerateMPI(PT pt)
 
 void PriorityQueue::PopNextBatch(int batch_size)
 {
-    // 修复min函数调用
-    int actual_batch_size = min(batch_size, min((int)priority.size(), mpi_size));
-    
-    if (actual_batch_size == 0) return;
-    
-    // 每个进程分配的PT索引
-    vector<int> pt_indices_per_process(mpi_size, -1);
-    vector<PT> pts_to_process(mpi_size);
-    
-    // 主进程分配PT给各进程
-    if (mpi_rank == 0) {
-        for (int i = 0; i < actual_batch_size && i < mpi_size; i++) {
-            pt_indices_per_process[i] = i;
-            pts_to_process[i] = priority[i];
-        }
+    // 每个进程都持有一份相同的优先队列副本
+    // 所有进程按照相同的顺序取出队首的至多min(batch_size, mpi_size)个PT，第i个PT由进程i负责生成猜测
+    // 每次出队之后都需要Seed，保证下一个出队的仍然是概率最高的PT
+    vector<PTRecord> batch;
+    while ((int)batch.size() < min(batch_size, mpi_size) && !priority.empty()) {
+        batch.emplace_back(priority.pop());
+        Seed();
     }
+    int actual_batch_size = batch.size();
     
-    // 广播分配信息到所有进程
-    MPI_Bcast(pt_indices_per_process.data(), mpi_size, MPI_INT, 0, MPI_COMM_WORLD);
+    if (actual_batch_size == 0) return;
     
-    // 广播PT数据到各进程（简化实现：每个进程接收所有PT，但只处理分配给自己的）
+    // 新PT的生成和概率计算开销很小，而且是确定性的
+    // 因此每个进程都为整批PT生成新PT，并按照相同的顺序入队，这样各进程的队列副本不需要通信就能保持一致
     for (int i = 0; i < actual_batch_size; i++) {
-        if (mpi_rank == 0) {
-            // 这里简化处理，实际应该序列化PT对象
-            // 为了工程实现，假设所有进程都有相同的优先队列副本
-        }
-    }
-    
-    // 各进程处理分配给自己的PT
-    vector<PT> new_pts_from_this_process;
-    
-    if (pt_indices_per_process[mpi_rank] != -1 && mpi_rank < actual_batch_size) {
-        // 当前进程需要处理PT
-        PT assigned_pt = priority[pt_indices_per_process[mpi_rank]];
-        new_pts_from_this_process = ProcessSinglePT(assigned_pt);
-    }
-    
-    // 收集所有进程生成的新PT数量
-    int local_new_pts_count = new_pts_from_this_process.size();
-    vector<int> all_new_pts_counts(mpi_size);
-    MPI_Allgather(&local_new_pts_count, 1, MPI_INT, 
-                  all_new_pts_counts.data(), 1, MPI_INT, MPI_COMM_WORLD);
-    
-    // 计算总的新PT数量
-    int total_new_pts = 0;
-    for (int count : all_new_pts_counts) {
-        total_new_pts += count;
-    }
-    
-    // 收集所有新生成的PT（简化：在主进程中处理）
-    if (mpi_rank == 0) {
-        // 移除已处理的PT
-        for (int i = actual_batch_size - 1; i >= 0; i--) {
-            priority.erase(priority.begin() + i);
-        }
-        
-        // 将新PT插入优先队列（简化处理）
-        for (int proc = 0; proc < mpi_size; proc++) {
-            if (pt_indices_per_process[proc] != -1) {
-                // 这里需要从其他进程接收新PT，简化为本地处理
-                if (proc == 0 && !new_pts_from_this_process.empty()) {
-                    InsertNewPTs(new_pts_from_this_process);
-                }
-            }
+        vector<PTRecord> new_pts;
+        if (i == mpi_rank) {
+            new_pts = ProcessSinglePT(batch[i]);
+        } else {
+            NewPTs(batch[i], new_pts);
         }
+        InsertNewPTs(new_pts);
     }
+    Seed();
     
-    // 同步优先队列状态（简化：重新广播）
+    // 检查各进程的队列副本是否一致
     BroadcastPriorityQueue();
 }
 
 // 处理单个PT并返回新生成的PT列表
-vector<PT> PriorityQueue::ProcessSinglePT(PT pt)
+vector<PTRecord> PriorityQueue::ProcessSinglePT(PTRecord pt)
 {
-    // 生成密码猜测
-    GenerateMPI(pt);
-    
-    // 生成新的PT
-    vector<PT> new_pts = pt.NewPTs();
-    
-    // 计算新PT的概率
-    for (PT& new_pt : new_pts) {
-        CalProb(new_pt);
-    }
+    // 生成密码猜测。PT层面并行时，一个PT只分配给一个进程，所以这里生成这个PT的全部猜测
+    Generate(pt);
     
+    // 生成新的PT，并计算新PT的概率
+    vector<PTRecord> new_pts;
+    NewPTs(pt, new_pts);
     return new_pts;
 }
 
 // 将新PT插入优先队列的辅助函数
-void PriorityQueue::InsertNewPTs(const vector<PT>& new_pts)
-{
-    for (const PT& pt : new_pts) {
-        // 按概率插入到正确位置
-        bool inserted = false;
-        for (auto iter = priority.begin(); iter != priority.end(); iter++) {
-            if (iter != priority.end() - 1 && iter != priority.begin()) {
-                if (pt.prob <= iter->prob && pt.prob > (iter + 1)->prob) {
-                    priority.emplace(iter + 1, pt);
-                    inserted = true;
-                    break;
-                }
-            }
-            if (iter == priority.end() - 1) {
-                priority.emplace_back(pt);
-                inserted = true;
-                break;
-            }
-            if (iter == priority.begin() && iter->prob < pt.prob) {
-                priority.emplace(iter, pt);
-                inserted = true;
-                break;
-            }
-        }
-        if (!inserted && priority.empty()) {
-            priority.emplace_back(pt);
-        }
+void PriorityQueue::InsertNewPTs(vector<PTRecord>& new_pts)
+{
+    for (PTRecord& pt : new_pts) {
+        priority.push(std::move(pt));
     }
 }
 
-// 广播优先队列状态的辅助函数（简化实现）
+// 检查各进程优先队列副本一致性的辅助函数
+// 各进程按照相同的顺序出队/入队，队列副本应当完全相同，这里只比较队列大小
 void PriorityQueue::BroadcastPriorityQueue()
 {
-    // 广播优先队列大小
     int queue_size = priority.size();
-    MPI_Bcast(&queue_size, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    
-    // 非主进程调整队列大小
-    if (mpi_rank != 0) {
-        priority.resize(queue_size);
+    int min_size, max_size;
+    MPI_Allreduce(&queue_size, &min_size, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    MPI_Allreduce(&queue_size, &max_size, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (min_size != max_size && mpi_rank == 0) {
+        cout << "Warning: priority queue replicas diverged (" << min_size << " vs " << max_size << ")" << endl;
     }
-    
-    // 这里应该序列化和广播PT对象，简化处理
-    // 实际实现中需要将PT对象序列化为字节流进行传输
-}
\ No newline at end of file
+}
+// 按块广播一段字节数据，root进程的buf为要发送的数据，其余进程的buf在返回时被替换为收到的数据
+// MPI_Bcast的count是int，数据较大时需要分块
+void BroadcastBuffer(string &buf, int root)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    long long size = buf.size();
+    MPI_Bcast(&size, 1, MPI_LONG_LONG, root, MPI_COMM_WORLD);
+    if (rank != root)
+    {
+        buf.resize(size);
+    }
+    const long long CHUNK = 1 << 30;
+    for (long long offset = 0; offset < size; offset += CHUNK)
+    {
+        int count = min(CHUNK, size - offset);
+        MPI_Bcast(&buf[offset], count, MPI_BYTE, root, MPI_COMM_WORLD);
+    }
+}
+
+// 广播模型：root进程序列化模型，其余进程接收后反序列化
+double PriorityQueue::BroadcastModel(int root)
+{
+    double start = MPI_Wtime();
+    string buf;
+    if (mpi_rank == root)
+    {
+        m.serialize(buf);
+    }
+    BroadcastBuffer(buf, root);
+    if (mpi_rank != root && !m.deserialize(buf.data(), buf.size()))
+    {
+        cout << "Rank " << mpi_rank << ": failed to deserialize the broadcast model" << endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    return MPI_Wtime() - start;
+}
@@ -7,34 +7,125 @@ using namespace std;
 using namespace chrono;
 
 // 编译指令如下
-// g++ main.cpp train.cpp guessing.cpp md5.cpp -o main
-// g++ main.cpp train.cpp guessing.cpp md5.cpp -o main -O1
-// g++ main.cpp train.cpp guessing.cpp md5.cpp -o main -O2
+// g++ main.cpp train.cpp guessing.cpp md5.cpp -o main -fopenmp
+// g++ main.cpp train.cpp guessing.cpp md5.cpp -o main -O1 -fopenmp
+// g++ main.cpp train.cpp guessing.cpp md5.cpp -o main -O2 -fopenmp
+// 可以加上-DMD5_INTERLEAVE=1/2/3/4，比较哈希时交错执行的4通道状态组数（即每次哈希4/8/12/16个猜测）
+// 在x86-64上同样可以编译，运行时根据CPU选择SSE2/AVX2/AVX-512实现，不需要额外的编译选项
+// 运行参数（可选）：./main bucket [每倍频程的桶数, 默认16] [fidelity]
+// 使用分桶优先队列代替默认的堆；加上fidelity时，在结束时输出出队顺序与严格概率顺序的偏差
+// 或者：./main multiqueue [线程数, 默认为OpenMP线程数]
+// 多个线程通过MultiQueue并发地出队PT、生成猜测并哈希，结束时输出rank error统计
+// 或者：./main fused
+// 生成与哈希融合：猜测直接写入MD5的通道交错布局并就地哈希，输出生成+哈希的总时间
+// 或者：./main deadbeat
+// 使用deadbeat dad规则导出新PT，猜测与默认规则相同，但队列小得多（结束时输出队列的峰值大小）
 
-int main()
+int main(int argc, char **argv)
 {
     double time_hash = 0;  // 用于MD5哈希的时间
     double time_guess = 0; // 哈希和猜测的总时长
     double time_train = 0; // 模型训练的总时长
     PriorityQueue q;
     auto start_train = system_clock::now();
-    q.m.train("/guessdata/Rockyou-singleLined-full.txt");
-    q.m.order();
+    // 优先mmap已经保存的模型，模型文件不存在、版本不匹配或者不是由当前训练集（路径、大小、修改时间、口令上限）训练得到时，
+    // 重新训练，并把训练结果保存下来供下次使用。加载模型时输出的Train time只是加载的时间，会特别注明
+    string train_path = "/guessdata/Rockyou-singleLined-full.txt";
+    bool cached = q.m.load_mapped("./model.map", train_path);
+    if (!cached)
+    {
+        // 多线程训练，结果与串行训练q.m.train(path)完全一致
+        q.m.train(train_path, omp_get_max_threads());
+        q.m.order();
+        q.m.store_mapped("./model.map", train_path);
+    }
+    string train_note = cached ? " (loaded cached ./model.map, not trained)" : "";
     auto end_train = system_clock::now();
     auto duration_train = duration_cast<microseconds>(end_train - start_train);
     time_train = double(duration_train.count()) * microseconds::period::num / microseconds::period::den;
 
+    if (argc > 1 && string(argv[1]) == "bucket")
+    {
+        q.priority.UseBuckets(argc > 2 ? atoi(argv[2]) : 16);
+        q.priority.track_fidelity = argc > 3 && string(argv[3]) == "fidelity";
+    }
+    q.deadbeat = argc > 1 && string(argv[1]) == "deadbeat";
     q.init();
     cout << "here" << endl;
+    cout << "MD5 backend: " << MD5BackendName(MD5CurrentBackend()) << endl;
+    if (argc > 1 && string(argv[1]) == "multiqueue")
+    {
+        int n_threads = argc > 2 ? atoi(argv[2]) : omp_get_max_threads();
+        PTMultiQueue mq(n_threads);
+        mq.track_rank_error = true;
+        auto start = system_clock::now();
+        // 每个线程在自己攒够的一批猜测上调用MD5Hash_Batch，它使用当前线程自己的MD5Hasher，各线程可以同时进行SIMD哈希
+        long long generated = q.PopParallel(mq, n_threads, 10000000, [](GuessBuffer &batch)
+        {
+            static thread_local vector<const uint8_t *> ptrs;
+            static thread_local vector<uint32_t> lens;
+            static thread_local vector<MD5Digest> digests;
+            ptrs.resize(batch.size());
+            lens.resize(batch.size());
+            for (size_t i = 0; i < batch.size(); i += 1)
+            {
+                ptrs[i] = (const uint8_t *)batch.data(i);
+                lens[i] = batch.length(i);
+            }
+            digests.resize(batch.size());
+            MD5Hash_Batch(ptrs.data(), lens.data(), batch.size(), digests.data());
+        });
+        auto end = system_clock::now();
+        auto duration = duration_cast<microseconds>(end - start);
+        time_guess = double(duration.count()) * microseconds::period::num / microseconds::period::den;
+        long long pops = max(1LL, mq.pops.load());
+        cout << "Guesses generated: " << generated << " with " << n_threads << " threads" << endl;
+        cout << "Guess+hash time:" << time_guess << "seconds" << endl;
+        cout << "Train time:" << time_train << "seconds" << train_note << endl;
+        cout << "Rank error: mean " << double(mq.rank_error_sum.load()) / pops
+             << ", max " << mq.rank_error_max.load() << " over " << mq.pops.load() << " pops" << endl;
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "fused")
+    {
+        // 每个猜测的MD5结果（4个字）按生成顺序存放在digests中，每100万个猜测清空一次
+        vector<bit32> digests;
+        auto start = system_clock::now();
+        long long history = 0;
+        while (!q.priority.empty() && history + q.total_guesses <= 10000000)
+        {
+            q.PopNextHash(digests);
+            if (digests.size() >= 4 * 1000000)
+            {
+                history += q.total_guesses;
+                q.total_guesses = 0;
+                digests.clear();
+            }
+        }
+        auto end = system_clock::now();
+        auto duration = duration_cast<microseconds>(end - start);
+        time_guess = double(duration.count()) * microseconds::period::num / microseconds::period::den;
+        cout << "Guesses generated and hashed: " << history + q.total_guesses << endl;
+        cout << "Guess+hash time:" << time_guess << "seconds" << endl;
+        cout << "Train time:" << time_train << "seconds" << train_note << endl;
+        return 0;
+    }
     int curr_num = 0;
     auto start = system_clock::now();
     // 由于需要定期清空内存，我们在这里记录已生成的猜测总数
     int history = 0;
+    // 优先队列的峰值大小
+    size_t max_queue = 0;
+    // 哈希时使用的输入数组和结果，在各批猜测之间复用
+    vector<const uint8_t *> ptrs;
+    vector<uint32_t> lens;
+    vector<MD5Digest> digests;
     // std::ofstream a("./output/results.txt");
     while (!q.priority.empty())
     {
         //cout<<"333444"<<endl;
         q.PopNext();
+        max_queue = max(max_queue, q.priority.size());
         q.total_guesses = q.guesses.size();
         if (q.total_guesses - curr_num >= 100000)
         {
@@ -50,7 +141,9 @@ int main()
                 time_guess = double(duration.count()) * microseconds::period::num / microseconds::period::den;
                 cout << "Guess time:" << time_guess - time_hash << "seconds"<< endl;
                 cout << "Hash time:" << time_hash << "seconds"<<endl;
-                cout << "Train time:" << time_train <<"seconds"<<endl;
+                cout << "Train time:" << time_train <<"seconds"<< train_note <<endl;
+                cout << "Peak queue size:" << max_queue << endl;
+                q.priority.PrintFidelity();
                 break;
             }
         }
@@ -75,39 +168,29 @@ int main()
             }*/
             auto start_hash = system_clock::now();
 
-            // 创建临时变量用于批处理
-            string inputs[4];
-            bit32 states[4][4];
-            
-             // 计算需要处理的完整批次
-            size_t complete_batches = q.guesses.size() / 4;
-
-            // 直接以4个一组方式处理密码
-            auto it = q.guesses.begin();
-            // 每次处理4个密码
-            for (size_t batch = 0; batch < complete_batches; batch++)
+            // 只记录猜测在q.guesses中的位置和长度，不复制猜测本身
+            ptrs.resize(q.guesses.size());
+            lens.resize(q.guesses.size());
+            for (size_t i = 0; i < q.guesses.size(); i++)
             {
-                
-                // 准备4个输入密码
-                for (int i = 0; i < 4; i++) {
-                    inputs[i] = *it++;
-                }
-        
-                // 调用SIMD版本的MD5哈希函数处理4个密码
-                MD5Hash_SIMD(inputs, states);
-        
-                // 如果需要处理哈希结果，可以在这里添加代码
-                // 例如输出或存储哈希值
-        /*
-        for (int i = 0; i < 4; i++) {
-            cout << "Password: " << inputs[i] << ", Hash: ";
-            for (int j = 0; j < 4; j++) {
-                cout << std::setw(8) << std::setfill('0') << hex << states[i][j];
-            }
-            cout << endl;
-        }*/
-        
+                ptrs[i] = (const uint8_t *)q.guesses.data(i);
+                lens[i] = q.guesses.length(i);
             }
+            digests.resize(q.guesses.size());
+
+            // 按长度、块数分桶之后再成组哈希，个别较长的猜测不会拖慢同组的其余猜测
+            // 第i个猜测的结果仍然位于digests[i]，与生成顺序一致
+            MD5Hash_Batch(ptrs.data(), lens.data(), q.guesses.size(), digests.data());
+
+            // 如果需要处理哈希结果，可以在这里添加代码，例如输出或存储哈希值
+            /*
+            for (size_t i = 0; i < q.guesses.size(); i++) {
+                cout << "Password: " << q.guesses.str(i) << ", Hash: ";
+                for (int j = 0; j < 4; j++) {
+                    cout << std::setw(8) << std::setfill('0') << hex << digests[i].state[j];
+                }
+                cout << endl;
+            }*/
             /*auto start_hash = system_clock::now();
 
             // 创建临时变量用于批处理
@@ -159,9 +242,9 @@ int main()
             // 记录已经生成的口令总数
             history += curr_num;
             curr_num = 0;
+            // clear只重置缓冲区，已经分配的内存留给下一批猜测使用
             q.guesses.clear();
         }
     }
-    CleanupMD5Resources();
     return 0;
 }
\ No newline at end of file
@@ -4,246 +4,241 @@
 #include <chrono>
 #include <algorithm>
 #include <thread> 
+#include <vector>
+#include <new>
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 using namespace chrono;
 
-/**
- * StringProcess: 将单个输入字符串转换成MD5计算所需的消息数组
- * @param input 输入
- * @param[out] n_byte 用于给调用者传递额外的返回值，即最终Byte数组的长度
- * @return Byte消息数组
- */
-Byte *StringProcess(string input, int *n_byte)
+// 用一个512bit的块x更新state
+static void MD5Transform(bit32 state[4], const bit32 x[16])
 {
-	// 将输入的字符串转换为Byte为单位的数组
-	Byte *blocks = (Byte *)input.c_str();
-	int length = input.length();
-
-	// 计算原始消息长度（以比特为单位）
-	int bitLength = length * 8;
-
-	// paddingBits: 原始消息需要的padding长度（以bit为单位）
-	// 对于给定的消息，将其补齐至length%512==448为止
-	// 需要注意的是，即便给定的消息满足length%512==448，也需要再pad 512bits
-	int paddingBits = bitLength % 512;
-	if (paddingBits > 448)
+	bit32 a = state[0], b = state[1], c = state[2], d = state[3];
+
+	/* Round 1 */
+	FF(a, b, c, d, x[0], s11, 0xd76aa478);
+	FF(d, a, b, c, x[1], s12, 0xe8c7b756);
+	FF(c, d, a, b, x[2], s13, 0x242070db);
+	FF(b, c, d, a, x[3], s14, 0xc1bdceee);
+	FF(a, b, c, d, x[4], s11, 0xf57c0faf);
+	FF(d, a, b, c, x[5], s12, 0x4787c62a);
+	FF(c, d, a, b, x[6], s13, 0xa8304613);
+	FF(b, c, d, a, x[7], s14, 0xfd469501);
+	FF(a, b, c, d, x[8], s11, 0x698098d8);
+	FF(d, a, b, c, x[9], s12, 0x8b44f7af);
+	FF(c, d, a, b, x[10], s13, 0xffff5bb1);
+	FF(b, c, d, a, x[11], s14, 0x895cd7be);
+	FF(a, b, c, d, x[12], s11, 0x6b901122);
+	FF(d, a, b, c, x[13], s12, 0xfd987193);
+	FF(c, d, a, b, x[14], s13, 0xa679438e);
+	FF(b, c, d, a, x[15], s14, 0x49b40821);
+
+	/* Round 2 */
+	GG(a, b, c, d, x[1], s21, 0xf61e2562);
+	GG(d, a, b, c, x[6], s22, 0xc040b340);
+	GG(c, d, a, b, x[11], s23, 0x265e5a51);
+	GG(b, c, d, a, x[0], s24, 0xe9b6c7aa);
+	GG(a, b, c, d, x[5], s21, 0xd62f105d);
+	GG(d, a, b, c, x[10], s22, 0x2441453);
+	GG(c, d, a, b, x[15], s23, 0xd8a1e681);
+	GG(b, c, d, a, x[4], s24, 0xe7d3fbc8);
+	GG(a, b, c, d, x[9], s21, 0x21e1cde6);
+	GG(d, a, b, c, x[14], s22, 0xc33707d6);
+	GG(c, d, a, b, x[3], s23, 0xf4d50d87);
+	GG(b, c, d, a, x[8], s24, 0x455a14ed);
+	GG(a, b, c, d, x[13], s21, 0xa9e3e905);
+	GG(d, a, b, c, x[2], s22, 0xfcefa3f8);
+	GG(c, d, a, b, x[7], s23, 0x676f02d9);
+	GG(b, c, d, a, x[12], s24, 0x8d2a4c8a);
+
+	/* Round 3 */
+	HH(a, b, c, d, x[5], s31, 0xfffa3942);
+	HH(d, a, b, c, x[8], s32, 0x8771f681);
+	HH(c, d, a, b, x[11], s33, 0x6d9d6122);
+	HH(b, c, d, a, x[14], s34, 0xfde5380c);
+	HH(a, b, c, d, x[1], s31, 0xa4beea44);
+	HH(d, a, b, c, x[4], s32, 0x4bdecfa9);
+	HH(c, d, a, b, x[7], s33, 0xf6bb4b60);
+	HH(b, c, d, a, x[10], s34, 0xbebfbc70);
+	HH(a, b, c, d, x[13], s31, 0x289b7ec6);
+	HH(d, a, b, c, x[0], s32, 0xeaa127fa);
+	HH(c, d, a, b, x[3], s33, 0xd4ef3085);
+	HH(b, c, d, a, x[6], s34, 0x4881d05);
+	HH(a, b, c, d, x[9], s31, 0xd9d4d039);
+	HH(d, a, b, c, x[12], s32, 0xe6db99e5);
+	HH(c, d, a, b, x[15], s33, 0x1fa27cf8);
+	HH(b, c, d, a, x[2], s34, 0xc4ac5665);
+
+	/* Round 4 */
+	II(a, b, c, d, x[0], s41, 0xf4292244);
+	II(d, a, b, c, x[7], s42, 0x432aff97);
+	II(c, d, a, b, x[14], s43, 0xab9423a7);
+	II(b, c, d, a, x[5], s44, 0xfc93a039);
+	II(a, b, c, d, x[12], s41, 0x655b59c3);
+	II(d, a, b, c, x[3], s42, 0x8f0ccc92);
+	II(c, d, a, b, x[10], s43, 0xffeff47d);
+	II(b, c, d, a, x[1], s44, 0x85845dd1);
+	II(a, b, c, d, x[8], s41, 0x6fa87e4f);
+	II(d, a, b, c, x[15], s42, 0xfe2ce6e0);
+	II(c, d, a, b, x[6], s43, 0xa3014314);
+	II(b, c, d, a, x[13], s44, 0x4e0811a1);
+	II(a, b, c, d, x[4], s41, 0xf7537e82);
+	II(d, a, b, c, x[11], s42, 0xbd3af235);
+	II(c, d, a, b, x[2], s43, 0x2ad7d2bb);
+	II(b, c, d, a, x[9], s44, 0xeb86d391);
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+}
+
+void MD5PrefixPrecompute(const char *prefix, size_t prefix_len, MD5PrefixState &st)
+{
+	st.full_blocks = prefix_len / 64;
+	st.steps = prefix_len % 64 / 4;
+	st.chain[0] = 0x67452301;
+	st.chain[1] = 0xefcdab89;
+	st.chain[2] = 0x98badcfe;
+	st.chain[3] = 0x10325476;
+
+	bit32 x[16];
+	for (int i = 0; i < st.full_blocks; i += 1)
 	{
-		paddingBits = 512 - (paddingBits - 448);
+		memcpy(x, prefix + i * 64, 64);
+		MD5Transform(st.chain, x);
 	}
-	else if (paddingBits < 448)
+
+	// 第1轮的前steps步，与MD5Transform中的顺序相同：第i步依次更新a, d, c, b
+	static const bit32 T1[16] = {0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+								 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821};
+	static const int S1[4] = {s11, s12, s13, s14};
+	memcpy(x, prefix + st.full_blocks * 64, st.steps * 4);
+	bit32 v[4] = {st.chain[0], st.chain[1], st.chain[2], st.chain[3]};
+	for (int i = 0; i < st.steps; i += 1)
 	{
-		paddingBits = 448 - paddingBits;
+		int t = (4 - i % 4) % 4;
+		FF(v[t], v[(t + 1) % 4], v[(t + 2) % 4], v[(t + 3) % 4], x[i], S1[i % 4], T1[i]);
 	}
-	else if (paddingBits == 448)
+	memcpy(st.abcd, v, sizeof(v));
+}
+
+// 处理消息末尾不足一个块的tail（tail_len < 64字节）：在栈上的缓冲区中完成填充，再更新一到两个块
+// total_len为整个消息的字节数，最后把state翻转字节序，得到与之前相同格式的结果
+static void MD5FinishTail(bit32 state[4], const Byte *tail, size_t tail_len, uint64_t total_len)
+{
+	Byte block[128];
+	memcpy(block, tail, tail_len);
+	block[tail_len] = 0x80;
+	// 填充之后还要放下8字节的长度，放不下时需要再补一个块
+	size_t padded = tail_len + 1 + 8 <= 64 ? 64 : 128;
+	memset(block + tail_len + 1, 0, padded - 8 - tail_len - 1);
+	uint64_t bit_length = total_len * 8;
+	memcpy(block + padded - 8, &bit_length, 8);
+
+	bit32 x[16];
+	for (size_t i = 0; i < padded; i += 64)
 	{
-		paddingBits = 512;
+		memcpy(x, block + i, 64);
+		MD5Transform(state, x);
 	}
 
-	// 原始消息需要的padding长度（以Byte为单位）
-	int paddingBytes = paddingBits / 8;
-	// 创建最终的字节数组
-	// length + paddingBytes + 8:
-	// 1. length为原始消息的长度（bits）
-	// 2. paddingBytes为原始消息需要的padding长度（Bytes）
-	// 3. 在pad到length%512==448之后，需要额外附加64bits的原始消息长度，即8个bytes
-	int paddedLength = length + paddingBytes + 8;
-	Byte *paddedMessage = new Byte[paddedLength];
-
-	// 复制原始消息
-	memcpy(paddedMessage, blocks, length);
-
-	// 添加填充字节。填充时，第一位为1，后面的所有位均为0。
-	// 所以第一个byte是0x80
-	paddedMessage[length] = 0x80;							 // 添加一个0x80字节
-	memset(paddedMessage + length + 1, 0, paddingBytes - 1); // 填充0字节
-
-	// 添加消息长度（64比特，小端格式）
-	for (int i = 0; i < 8; ++i)
+	for (int i = 0; i < 4; i++)
 	{
-		// 特别注意此处应当将bitLength转换为uint64_t
-		// 这里的length是原始消息的长度
-		paddedMessage[length + paddingBytes + i] = ((uint64_t)length * 8 >> (i * 8)) & 0xFF;
+		state[i] = __builtin_bswap32(state[i]);
 	}
+}
 
-	// 验证长度是否满足要求。此时长度应当是512bit的倍数
-	int residual = 8 * paddedLength % 512;
-	// assert(residual == 0);
+void MD5Init(MD5Context &ctx)
+{
+	ctx.state[0] = 0x67452301;
+	ctx.state[1] = 0xefcdab89;
+	ctx.state[2] = 0x98badcfe;
+	ctx.state[3] = 0x10325476;
+	ctx.length = 0;
+}
 
-	// 在填充+添加长度之后，消息被分为n_blocks个512bit的部分
-	*n_byte = paddedLength;
-	return paddedMessage;
+void MD5Update(MD5Context &ctx, const char *input, size_t length)
+{
+	size_t buffered = ctx.length % 64;
+	ctx.length += length;
+	bit32 x[16];
+	// 先把缓冲区中上次剩下的数据补满一个块
+	if (buffered > 0)
+	{
+		size_t n = min(length, 64 - buffered);
+		memcpy(ctx.buffer + buffered, input, n);
+		input += n;
+		length -= n;
+		if (buffered + n < 64)
+		{
+			return;
+		}
+		memcpy(x, ctx.buffer, 64);
+		MD5Transform(ctx.state, x);
+	}
+	// 完整的块直接从input读取
+	for (; length >= 64; input += 64, length -= 64)
+	{
+		memcpy(x, input, 64);
+		MD5Transform(ctx.state, x);
+	}
+	memcpy(ctx.buffer, input, length);
 }
 
+void MD5Final(MD5Context &ctx, bit32 *state)
+{
+	MD5FinishTail(ctx.state, ctx.buffer, ctx.length % 64, ctx.length);
+	memcpy(state, ctx.state, sizeof(ctx.state));
+}
 
 /**
- * MD5Hash: 将单个输入字符串转换成MD5
+ * MD5Hash: 将单个输入转换成MD5
  * @param input 输入
+ * @param length 输入的字节数
  * @param[out] state 用于给调用者传递额外的返回值，即最终的缓冲区，也就是MD5的结果
- * @return Byte消息数组
+ * 不分配内存：完整的块直接从input读取，只有最后的一两个块在栈上填充
  */
-void MD5Hash(string input, bit32 *state)
+void MD5Hash(const char *input, size_t length, bit32 *state)
 {
-
-	Byte *paddedMessage;
-	int *messageLength = new int[1];
-	for (int i = 0; i < 1; i += 1)
-	{
-		paddedMessage = StringProcess(input, &messageLength[i]);
-		// cout<<messageLength[i]<<endl;
-		assert(messageLength[i] == messageLength[0]);
-	}
-	int n_blocks = messageLength[0] / 64;
-
-	// bit32* state= new bit32[4];
 	state[0] = 0x67452301;
 	state[1] = 0xefcdab89;
 	state[2] = 0x98badcfe;
 	state[3] = 0x10325476;
 
 	// 逐block地更新state
-	for (int i = 0; i < n_blocks; i += 1)
-	{
-		bit32 x[16];
-
-		// 下面的处理，在理解上较为复杂
-		for (int i1 = 0; i1 < 16; ++i1)
-		{
-			x[i1] = (paddedMessage[4 * i1 + i * 64]) |
-					(paddedMessage[4 * i1 + 1 + i * 64] << 8) |
-					(paddedMessage[4 * i1 + 2 + i * 64] << 16) |
-					(paddedMessage[4 * i1 + 3 + i * 64] << 24);
-		}
-
-		bit32 a = state[0], b = state[1], c = state[2], d = state[3];
-
-		auto start = system_clock::now();
-		/* Round 1 */
-		FF(a, b, c, d, x[0], s11, 0xd76aa478);
-		FF(d, a, b, c, x[1], s12, 0xe8c7b756);
-		FF(c, d, a, b, x[2], s13, 0x242070db);
-		FF(b, c, d, a, x[3], s14, 0xc1bdceee);
-		FF(a, b, c, d, x[4], s11, 0xf57c0faf);
-		FF(d, a, b, c, x[5], s12, 0x4787c62a);
-		FF(c, d, a, b, x[6], s13, 0xa8304613);
-		FF(b, c, d, a, x[7], s14, 0xfd469501);
-		FF(a, b, c, d, x[8], s11, 0x698098d8);
-		FF(d, a, b, c, x[9], s12, 0x8b44f7af);
-		FF(c, d, a, b, x[10], s13, 0xffff5bb1);
-		FF(b, c, d, a, x[11], s14, 0x895cd7be);
-		FF(a, b, c, d, x[12], s11, 0x6b901122);
-		FF(d, a, b, c, x[13], s12, 0xfd987193);
-		FF(c, d, a, b, x[14], s13, 0xa679438e);
-		FF(b, c, d, a, x[15], s14, 0x49b40821);
-
-		/* Round 2 */
-		GG(a, b, c, d, x[1], s21, 0xf61e2562);
-		GG(d, a, b, c, x[6], s22, 0xc040b340);
-		GG(c, d, a, b, x[11], s23, 0x265e5a51);
-		GG(b, c, d, a, x[0], s24, 0xe9b6c7aa);
-		GG(a, b, c, d, x[5], s21, 0xd62f105d);
-		GG(d, a, b, c, x[10], s22, 0x2441453);
-		GG(c, d, a, b, x[15], s23, 0xd8a1e681);
-		GG(b, c, d, a, x[4], s24, 0xe7d3fbc8);
-		GG(a, b, c, d, x[9], s21, 0x21e1cde6);
-		GG(d, a, b, c, x[14], s22, 0xc33707d6);
-		GG(c, d, a, b, x[3], s23, 0xf4d50d87);
-		GG(b, c, d, a, x[8], s24, 0x455a14ed);
-		GG(a, b, c, d, x[13], s21, 0xa9e3e905);
-		GG(d, a, b, c, x[2], s22, 0xfcefa3f8);
-		GG(c, d, a, b, x[7], s23, 0x676f02d9);
-		GG(b, c, d, a, x[12], s24, 0x8d2a4c8a);
-
-		/* Round 3 */
-		HH(a, b, c, d, x[5], s31, 0xfffa3942);
-		HH(d, a, b, c, x[8], s32, 0x8771f681);
-		HH(c, d, a, b, x[11], s33, 0x6d9d6122);
-		HH(b, c, d, a, x[14], s34, 0xfde5380c);
-		HH(a, b, c, d, x[1], s31, 0xa4beea44);
-		HH(d, a, b, c, x[4], s32, 0x4bdecfa9);
-		HH(c, d, a, b, x[7], s33, 0xf6bb4b60);
-		HH(b, c, d, a, x[10], s34, 0xbebfbc70);
-		HH(a, b, c, d, x[13], s31, 0x289b7ec6);
-		HH(d, a, b, c, x[0], s32, 0xeaa127fa);
-		HH(c, d, a, b, x[3], s33, 0xd4ef3085);
-		HH(b, c, d, a, x[6], s34, 0x4881d05);
-		HH(a, b, c, d, x[9], s31, 0xd9d4d039);
-		HH(d, a, b, c, x[12], s32, 0xe6db99e5);
-		HH(c, d, a, b, x[15], s33, 0x1fa27cf8);
-		HH(b, c, d, a, x[2], s34, 0xc4ac5665);
-
-		/* Round 4 */
-		II(a, b, c, d, x[0], s41, 0xf4292244);
-		II(d, a, b, c, x[7], s42, 0x432aff97);
-		II(c, d, a, b, x[14], s43, 0xab9423a7);
-		II(b, c, d, a, x[5], s44, 0xfc93a039);
-		II(a, b, c, d, x[12], s41, 0x655b59c3);
-		II(d, a, b, c, x[3], s42, 0x8f0ccc92);
-		II(c, d, a, b, x[10], s43, 0xffeff47d);
-		II(b, c, d, a, x[1], s44, 0x85845dd1);
-		II(a, b, c, d, x[8], s41, 0x6fa87e4f);
-		II(d, a, b, c, x[15], s42, 0xfe2ce6e0);
-		II(c, d, a, b, x[6], s43, 0xa3014314);
-		II(b, c, d, a, x[13], s44, 0x4e0811a1);
-		II(a, b, c, d, x[4], s41, 0xf7537e82);
-		II(d, a, b, c, x[11], s42, 0xbd3af235);
-		II(c, d, a, b, x[2], s43, 0x2ad7d2bb);
-		II(b, c, d, a, x[9], s44, 0xeb86d391);
-
-		state[0] += a;
-		state[1] += b;
-		state[2] += c;
-		state[3] += d;
-	}
-
-	// 下面的处理，在理解上较为复杂
-	for (int i = 0; i < 4; i++)
+	bit32 x[16];
+	size_t full = length / 64 * 64;
+	for (size_t i = 0; i < full; i += 64)
 	{
-		uint32_t value = state[i];
-		state[i] = ((value & 0xff) << 24) |		 // 将最低字节移到最高位
-				   ((value & 0xff00) << 8) |	 // 将次低字节左移
-				   ((value & 0xff0000) >> 8) |	 // 将次高字节右移
-				   ((value & 0xff000000) >> 24); // 将最高字节移到最低位
+		memcpy(x, input + i, 64);
+		MD5Transform(state, x);
 	}
+	MD5FinishTail(state, (const Byte *)input + full, length - full, length);
+}
 
-	// 输出最终的hash结果
-	// for (int i1 = 0; i1 < 4; i1 += 1)
-	// {
-	// 	cout << std::setw(8) << std::setfill('0') << hex << state[i1];
-	// }
-	// cout << endl;
-
-	// 释放动态分配的内存
-	// 实现SIMD并行算法的时候，也请记得及时回收内存！
-	delete[] paddedMessage;
-	delete[] messageLength;
+void MD5Hash(const string &input, bit32 *state)
+{
+	MD5Hash(input.data(), input.length(), state);
 }
 
-void PrepareMessage(const string& input, Byte* output, int* output_length) {
+void PrepareMessage(const char* input, size_t input_length, Byte* output, int* output_length) {
     // 复制原始消息
-    size_t input_length = input.length();
-    memcpy(output, input.c_str(), input_length);
+    memcpy(output, input, input_length);
     
-    // 计算填充
+    // 计算填充：填充之后的长度模64余56，并且至少填充一个字节（0x80），因此padding_bytes在1到64之间
     size_t bitLength = input_length * 8;
-    size_t padding_bits = bitLength % 512;
-    size_t padding_bytes;
-    
-    if (padding_bits < 448) {
-        padding_bytes = (448 - padding_bits) / 8;
-    } else {
-        padding_bytes = (512 + 448 - padding_bits) / 8;
-    }
+    unsigned int remainder = input_length % 64;
+    unsigned int padding_bytes = remainder < 56 ? 56 - remainder : 120 - remainder;
     
     // 添加填充
     output[input_length] = 0x80;
-    
-    // 使用预定义的zero_buffer进行快速填充
-    if (padding_bytes - 1 <= MAX_BUFFER_SIZE) {
-        memcpy(output + input_length + 1, zero_buffer, padding_bytes - 1);
-    } else {
-        memset(output + input_length + 1, 0, padding_bytes - 1);
-    }
+    memset(output + input_length + 1, 0, padding_bytes - 1);
     
     // 添加长度字段
     for (int i = 0; i < 8; ++i) {
@@ -253,171 +248,231 @@ void PrepareMessage(const string& input, Byte* output, int* output_length) {
     *output_length = input_length + padding_bytes + 8;
 }
 
-void MD5Hash_SIMD(const string inputs[4], bit32 states[4][4]) {
-    // 初始状态值
-    bit32x4_t a0 = vdupq_n_u32(0x67452301);
-    bit32x4_t b0 = vdupq_n_u32(0xefcdab89);
-    bit32x4_t c0 = vdupq_n_u32(0x98badcfe);
-    bit32x4_t d0 = vdupq_n_u32(0x10325476);
-    
-    // 为每个字符串准备填充后的数据
-    Byte* paddedMessages[4];
-    int messageLengths[4];
-    
-	// 找出最长的输入
-    size_t max_length = std::max({inputs[0].length(), inputs[1].length(), 
-		inputs[2].length(), inputs[3].length()});
-    
-    // 计算所需的最大缓冲区大小
-    size_t padded_size = ((max_length + 64 + 8 + 63) / 64) * 64; // 确保64字节对齐
-    
-    // 确保缓冲区足够大
-    if (!reusable_buffers || total_buffer_capacity < 4 * padded_size) {
-        delete[] reusable_buffers; // 安全删除之前的缓冲区
-        reusable_buffers = new Byte[4 * padded_size];
-        total_buffer_capacity = 4 * padded_size;
-    }
-    
-    for (int i = 0; i < 4; i++) {
-        paddedMessages[i] = reusable_buffers + i * padded_size;
-        PrepareMessage(inputs[i], paddedMessages[i], &messageLengths[i]);
-    }
-    
-    // 确认所有消息块的数量相同
-	int n_blocks = messageLengths[0] / 64;
-	assert(messageLengths[1] / 64 == n_blocks);
-	assert(messageLengths[2] / 64 == n_blocks);
-	assert(messageLengths[3] / 64 == n_blocks);
-
+// 对4个通道各处理一个512bit的块：M[j]的第l个分量为第l个输入当前块的第j个字，a0~d0为4个通道的状态
+// start > 0时，第1轮的前start步已经完成（这些步只依赖于各通道相同的前缀，由MD5PrefixPrecompute预先算好），A~D为完成这些步之后的值
+static inline void MD5BlockFrom_SIMD(bit32x4_t &a0, bit32x4_t &b0, bit32x4_t &c0, bit32x4_t &d0, const bit32x4_t *M,
+                                     int start, bit32x4_t A, bit32x4_t B, bit32x4_t C, bit32x4_t D) {
+    // MD5算法的四轮操作(完全按照原始算法)
     
-    // 处理每个块
-    for (size_t block = 0; block < n_blocks; block++) {
-         // 使用静态预分配的数组替代栈上数组
-		 bit32x4_t* M = M_static;
-
-		 // 预计算块基址偏移，减少每次计算
-		const size_t block_base = block * 64;
-
-		
-
-        // 如果不是最后一个块，预加载下一个块的前几个字
-    if (block < n_blocks - 1) {
-        // 仅预加载下一个块的开始部分
-        __builtin_prefetch(paddedMessages[0] + block_base + 64, 0, 3);
-        __builtin_prefetch(paddedMessages[1] + block_base + 64, 0, 3);
-        __builtin_prefetch(paddedMessages[2] + block_base + 64, 0, 3);
-        __builtin_prefetch(paddedMessages[3] + block_base + 64, 0, 3);
-    }
-
-    for (int j = 0; j < 16; j++) {
-        // 一次性计算偏移量
-        const size_t offset = block_base + j * 4;
-        
-        // 每4个字进行一次预加载，减少预加载指令的数量
-        if (j % 4 == 0 && j < 12) {
-            // 为当前块的后续数据预加载
-            __builtin_prefetch(paddedMessages[0] + offset + 16, 0, 2);
-            __builtin_prefetch(paddedMessages[1] + offset + 16, 0, 2);
-            __builtin_prefetch(paddedMessages[2] + offset + 16, 0, 2);
-            __builtin_prefetch(paddedMessages[3] + offset + 16, 0, 2);
-        }
-        
-        uint32_t values[4] __attribute__((aligned(16)));
-    	values[0] = *(uint32_t*)(paddedMessages[0] + offset);
-    	values[1] = *(uint32_t*)(paddedMessages[1] + offset);
-    	values[2] = *(uint32_t*)(paddedMessages[2] + offset);
-    	values[3] = *(uint32_t*)(paddedMessages[3] + offset);
-        
-        M[j] = vld1q_u32(values);
-    }
-        
-        // 保存当前轮的哈希值
-        bit32x4_t A = a0;
-        bit32x4_t B = b0;
-        bit32x4_t C = c0;
-        bit32x4_t D = d0;
-        
-        // MD5算法的四轮操作(完全按照原始算法)
-        
-        // 第1轮操作
+    // 第1轮操作，从第start步开始（case之间有意不加break，用[[fallthrough]]标明）
+    switch (start) {
+    case 0:
         FF_SIMD(A, B, C, D, M[0], s11, 0xd76aa478);
+        [[fallthrough]];
+    case 1:
         FF_SIMD(D, A, B, C, M[1], s12, 0xe8c7b756);
+        [[fallthrough]];
+    case 2:
         FF_SIMD(C, D, A, B, M[2], s13, 0x242070db);
+        [[fallthrough]];
+    case 3:
         FF_SIMD(B, C, D, A, M[3], s14, 0xc1bdceee);
+        [[fallthrough]];
+    case 4:
         FF_SIMD(A, B, C, D, M[4], s11, 0xf57c0faf);
+        [[fallthrough]];
+    case 5:
         FF_SIMD(D, A, B, C, M[5], s12, 0x4787c62a);
+        [[fallthrough]];
+    case 6:
         FF_SIMD(C, D, A, B, M[6], s13, 0xa8304613);
+        [[fallthrough]];
+    case 7:
         FF_SIMD(B, C, D, A, M[7], s14, 0xfd469501);
+        [[fallthrough]];
+    case 8:
         FF_SIMD(A, B, C, D, M[8], s11, 0x698098d8);
+        [[fallthrough]];
+    case 9:
         FF_SIMD(D, A, B, C, M[9], s12, 0x8b44f7af);
+        [[fallthrough]];
+    case 10:
         FF_SIMD(C, D, A, B, M[10], s13, 0xffff5bb1);
+        [[fallthrough]];
+    case 11:
         FF_SIMD(B, C, D, A, M[11], s14, 0x895cd7be);
+        [[fallthrough]];
+    case 12:
         FF_SIMD(A, B, C, D, M[12], s11, 0x6b901122);
+        [[fallthrough]];
+    case 13:
         FF_SIMD(D, A, B, C, M[13], s12, 0xfd987193);
+        [[fallthrough]];
+    case 14:
         FF_SIMD(C, D, A, B, M[14], s13, 0xa679438e);
+        [[fallthrough]];
+    case 15:
         FF_SIMD(B, C, D, A, M[15], s14, 0x49b40821);
-        
-        // 第2轮操作
-        GG_SIMD(A, B, C, D, M[1], s21, 0xf61e2562);
-        GG_SIMD(D, A, B, C, M[6], s22, 0xc040b340);
-        GG_SIMD(C, D, A, B, M[11], s23, 0x265e5a51);
-        GG_SIMD(B, C, D, A, M[0], s24, 0xe9b6c7aa);
-        GG_SIMD(A, B, C, D, M[5], s21, 0xd62f105d);
-        GG_SIMD(D, A, B, C, M[10], s22, 0x02441453);  
-        GG_SIMD(C, D, A, B, M[15], s23, 0xd8a1e681);
-        GG_SIMD(B, C, D, A, M[4], s24, 0xe7d3fbc8);
-        GG_SIMD(A, B, C, D, M[9], s21, 0x21e1cde6);
-        GG_SIMD(D, A, B, C, M[14], s22, 0xc33707d6);
-        GG_SIMD(C, D, A, B, M[3], s23, 0xf4d50d87);
-        GG_SIMD(B, C, D, A, M[8], s24, 0x455a14ed);
-        GG_SIMD(A, B, C, D, M[13], s21, 0xa9e3e905);
-        GG_SIMD(D, A, B, C, M[2], s22, 0xfcefa3f8);
-        GG_SIMD(C, D, A, B, M[7], s23, 0x676f02d9);
-        GG_SIMD(B, C, D, A, M[12], s24, 0x8d2a4c8a);
-        
-        // 第3轮操作
-        HH_SIMD(A, B, C, D, M[5], s31, 0xfffa3942);
-        HH_SIMD(D, A, B, C, M[8], s32, 0x8771f681);
-        HH_SIMD(C, D, A, B, M[11], s33, 0x6d9d6122);
-        HH_SIMD(B, C, D, A, M[14], s34, 0xfde5380c);
-        HH_SIMD(A, B, C, D, M[1], s31, 0xa4beea44);
-        HH_SIMD(D, A, B, C, M[4], s32, 0x4bdecfa9);
-        HH_SIMD(C, D, A, B, M[7], s33, 0xf6bb4b60);
-        HH_SIMD(B, C, D, A, M[10], s34, 0xbebfbc70);
-        HH_SIMD(A, B, C, D, M[13], s31, 0x289b7ec6);
-        HH_SIMD(D, A, B, C, M[0], s32, 0xeaa127fa);
-        HH_SIMD(C, D, A, B, M[3], s33, 0xd4ef3085);
-        HH_SIMD(B, C, D, A, M[6], s34, 0x04881d05);  
-        HH_SIMD(A, B, C, D, M[9], s31, 0xd9d4d039);
-        HH_SIMD(D, A, B, C, M[12], s32, 0xe6db99e5);
-        HH_SIMD(C, D, A, B, M[15], s33, 0x1fa27cf8);
-        HH_SIMD(B, C, D, A, M[2], s34, 0xc4ac5665);
-        
-        // 第4轮操作
-        II_SIMD(A, B, C, D, M[0], s41, 0xf4292244);
-        II_SIMD(D, A, B, C, M[7], s42, 0x432aff97);
-        II_SIMD(C, D, A, B, M[14], s43, 0xab9423a7);
-        II_SIMD(B, C, D, A, M[5], s44, 0xfc93a039);
-        II_SIMD(A, B, C, D, M[12], s41, 0x655b59c3);
-        II_SIMD(D, A, B, C, M[3], s42, 0x8f0ccc92);
-        II_SIMD(C, D, A, B, M[10], s43, 0xffeff47d);
-        II_SIMD(B, C, D, A, M[1], s44, 0x85845dd1);
-        II_SIMD(A, B, C, D, M[8], s41, 0x6fa87e4f);
-        II_SIMD(D, A, B, C, M[15], s42, 0xfe2ce6e0);
-        II_SIMD(C, D, A, B, M[6], s43, 0xa3014314);
-        II_SIMD(B, C, D, A, M[13], s44, 0x4e0811a1);
-        II_SIMD(A, B, C, D, M[4], s41, 0xf7537e82);
-        II_SIMD(D, A, B, C, M[11], s42, 0xbd3af235);
-        II_SIMD(C, D, A, B, M[2], s43, 0x2ad7d2bb);
-        II_SIMD(B, C, D, A, M[9], s44, 0xeb86d391);
-        
-        // 更新状态
-        a0 = vaddq_u32(a0, A);
-        b0 = vaddq_u32(b0, B);
-        c0 = vaddq_u32(c0, C);
-        d0 = vaddq_u32(d0, D);
     }
     
+    // 第2轮操作
+    GG_SIMD(A, B, C, D, M[1], s21, 0xf61e2562);
+    GG_SIMD(D, A, B, C, M[6], s22, 0xc040b340);
+    GG_SIMD(C, D, A, B, M[11], s23, 0x265e5a51);
+    GG_SIMD(B, C, D, A, M[0], s24, 0xe9b6c7aa);
+    GG_SIMD(A, B, C, D, M[5], s21, 0xd62f105d);
+    GG_SIMD(D, A, B, C, M[10], s22, 0x02441453);  
+    GG_SIMD(C, D, A, B, M[15], s23, 0xd8a1e681);
+    GG_SIMD(B, C, D, A, M[4], s24, 0xe7d3fbc8);
+    GG_SIMD(A, B, C, D, M[9], s21, 0x21e1cde6);
+    GG_SIMD(D, A, B, C, M[14], s22, 0xc33707d6);
+    GG_SIMD(C, D, A, B, M[3], s23, 0xf4d50d87);
+    GG_SIMD(B, C, D, A, M[8], s24, 0x455a14ed);
+    GG_SIMD(A, B, C, D, M[13], s21, 0xa9e3e905);
+    GG_SIMD(D, A, B, C, M[2], s22, 0xfcefa3f8);
+    GG_SIMD(C, D, A, B, M[7], s23, 0x676f02d9);
+    GG_SIMD(B, C, D, A, M[12], s24, 0x8d2a4c8a);
+    
+    // 第3轮操作
+    HH_SIMD(A, B, C, D, M[5], s31, 0xfffa3942);
+    HH_SIMD(D, A, B, C, M[8], s32, 0x8771f681);
+    HH_SIMD(C, D, A, B, M[11], s33, 0x6d9d6122);
+    HH_SIMD(B, C, D, A, M[14], s34, 0xfde5380c);
+    HH_SIMD(A, B, C, D, M[1], s31, 0xa4beea44);
+    HH_SIMD(D, A, B, C, M[4], s32, 0x4bdecfa9);
+    HH_SIMD(C, D, A, B, M[7], s33, 0xf6bb4b60);
+    HH_SIMD(B, C, D, A, M[10], s34, 0xbebfbc70);
+    HH_SIMD(A, B, C, D, M[13], s31, 0x289b7ec6);
+    HH_SIMD(D, A, B, C, M[0], s32, 0xeaa127fa);
+    HH_SIMD(C, D, A, B, M[3], s33, 0xd4ef3085);
+    HH_SIMD(B, C, D, A, M[6], s34, 0x04881d05);  
+    HH_SIMD(A, B, C, D, M[9], s31, 0xd9d4d039);
+    HH_SIMD(D, A, B, C, M[12], s32, 0xe6db99e5);
+    HH_SIMD(C, D, A, B, M[15], s33, 0x1fa27cf8);
+    HH_SIMD(B, C, D, A, M[2], s34, 0xc4ac5665);
+    
+    // 第4轮操作
+    II_SIMD(A, B, C, D, M[0], s41, 0xf4292244);
+    II_SIMD(D, A, B, C, M[7], s42, 0x432aff97);
+    II_SIMD(C, D, A, B, M[14], s43, 0xab9423a7);
+    II_SIMD(B, C, D, A, M[5], s44, 0xfc93a039);
+    II_SIMD(A, B, C, D, M[12], s41, 0x655b59c3);
+    II_SIMD(D, A, B, C, M[3], s42, 0x8f0ccc92);
+    II_SIMD(C, D, A, B, M[10], s43, 0xffeff47d);
+    II_SIMD(B, C, D, A, M[1], s44, 0x85845dd1);
+    II_SIMD(A, B, C, D, M[8], s41, 0x6fa87e4f);
+    II_SIMD(D, A, B, C, M[15], s42, 0xfe2ce6e0);
+    II_SIMD(C, D, A, B, M[6], s43, 0xa3014314);
+    II_SIMD(B, C, D, A, M[13], s44, 0x4e0811a1);
+    II_SIMD(A, B, C, D, M[4], s41, 0xf7537e82);
+    II_SIMD(D, A, B, C, M[11], s42, 0xbd3af235);
+    II_SIMD(C, D, A, B, M[2], s43, 0x2ad7d2bb);
+    II_SIMD(B, C, D, A, M[9], s44, 0xeb86d391);
+    
+    // 更新状态
+    a0 = vaddq_u32(a0, A);
+    b0 = vaddq_u32(b0, B);
+    c0 = vaddq_u32(c0, C);
+    d0 = vaddq_u32(d0, D);
+}
+
+static inline void MD5Block_SIMD(bit32x4_t &a0, bit32x4_t &b0, bit32x4_t &c0, bit32x4_t &d0, const bit32x4_t *M) {
+    MD5BlockFrom_SIMD(a0, b0, c0, d0, M, 0, a0, b0, c0, d0);
+}
+
+// K组4通道状态交错执行同一个块：每一步依次作用于K组互不依赖的状态，
+// 前一组的加法和循环移位还在流水线中时，后一组的指令就可以发射，从而隐藏指令延迟
+// M[k][j]为第k组4个通道当前块的第j个字
+#define MD5_STEP_K(OP, a, b, c, d, j, s, ac) \
+    for (int k = 0; k < K; k++) { \
+        OP(a[k], b[k], c[k], d[k], M[k][j], s, ac); \
+    }
+
+template <int K>
+static inline void MD5BlockInterleaved_SIMD(bit32x4_t a0[K], bit32x4_t b0[K], bit32x4_t c0[K], bit32x4_t d0[K], const bit32x4_t M[K][16]) {
+    bit32x4_t A[K], B[K], C[K], D[K];
+    for (int k = 0; k < K; k++) {
+        A[k] = a0[k];
+        B[k] = b0[k];
+        C[k] = c0[k];
+        D[k] = d0[k];
+    }
+
+    // 第1轮操作
+    MD5_STEP_K(FF_SIMD, A, B, C, D, 0, s11, 0xd76aa478);
+    MD5_STEP_K(FF_SIMD, D, A, B, C, 1, s12, 0xe8c7b756);
+    MD5_STEP_K(FF_SIMD, C, D, A, B, 2, s13, 0x242070db);
+    MD5_STEP_K(FF_SIMD, B, C, D, A, 3, s14, 0xc1bdceee);
+    MD5_STEP_K(FF_SIMD, A, B, C, D, 4, s11, 0xf57c0faf);
+    MD5_STEP_K(FF_SIMD, D, A, B, C, 5, s12, 0x4787c62a);
+    MD5_STEP_K(FF_SIMD, C, D, A, B, 6, s13, 0xa8304613);
+    MD5_STEP_K(FF_SIMD, B, C, D, A, 7, s14, 0xfd469501);
+    MD5_STEP_K(FF_SIMD, A, B, C, D, 8, s11, 0x698098d8);
+    MD5_STEP_K(FF_SIMD, D, A, B, C, 9, s12, 0x8b44f7af);
+    MD5_STEP_K(FF_SIMD, C, D, A, B, 10, s13, 0xffff5bb1);
+    MD5_STEP_K(FF_SIMD, B, C, D, A, 11, s14, 0x895cd7be);
+    MD5_STEP_K(FF_SIMD, A, B, C, D, 12, s11, 0x6b901122);
+    MD5_STEP_K(FF_SIMD, D, A, B, C, 13, s12, 0xfd987193);
+    MD5_STEP_K(FF_SIMD, C, D, A, B, 14, s13, 0xa679438e);
+    MD5_STEP_K(FF_SIMD, B, C, D, A, 15, s14, 0x49b40821);
+    
+    // 第2轮操作
+    MD5_STEP_K(GG_SIMD, A, B, C, D, 1, s21, 0xf61e2562);
+    MD5_STEP_K(GG_SIMD, D, A, B, C, 6, s22, 0xc040b340);
+    MD5_STEP_K(GG_SIMD, C, D, A, B, 11, s23, 0x265e5a51);
+    MD5_STEP_K(GG_SIMD, B, C, D, A, 0, s24, 0xe9b6c7aa);
+    MD5_STEP_K(GG_SIMD, A, B, C, D, 5, s21, 0xd62f105d);
+    MD5_STEP_K(GG_SIMD, D, A, B, C, 10, s22, 0x02441453);
+    MD5_STEP_K(GG_SIMD, C, D, A, B, 15, s23, 0xd8a1e681);
+    MD5_STEP_K(GG_SIMD, B, C, D, A, 4, s24, 0xe7d3fbc8);
+    MD5_STEP_K(GG_SIMD, A, B, C, D, 9, s21, 0x21e1cde6);
+    MD5_STEP_K(GG_SIMD, D, A, B, C, 14, s22, 0xc33707d6);
+    MD5_STEP_K(GG_SIMD, C, D, A, B, 3, s23, 0xf4d50d87);
+    MD5_STEP_K(GG_SIMD, B, C, D, A, 8, s24, 0x455a14ed);
+    MD5_STEP_K(GG_SIMD, A, B, C, D, 13, s21, 0xa9e3e905);
+    MD5_STEP_K(GG_SIMD, D, A, B, C, 2, s22, 0xfcefa3f8);
+    MD5_STEP_K(GG_SIMD, C, D, A, B, 7, s23, 0x676f02d9);
+    MD5_STEP_K(GG_SIMD, B, C, D, A, 12, s24, 0x8d2a4c8a);
+
+    // 第3轮操作
+    MD5_STEP_K(HH_SIMD, A, B, C, D, 5, s31, 0xfffa3942);
+    MD5_STEP_K(HH_SIMD, D, A, B, C, 8, s32, 0x8771f681);
+    MD5_STEP_K(HH_SIMD, C, D, A, B, 11, s33, 0x6d9d6122);
+    MD5_STEP_K(HH_SIMD, B, C, D, A, 14, s34, 0xfde5380c);
+    MD5_STEP_K(HH_SIMD, A, B, C, D, 1, s31, 0xa4beea44);
+    MD5_STEP_K(HH_SIMD, D, A, B, C, 4, s32, 0x4bdecfa9);
+    MD5_STEP_K(HH_SIMD, C, D, A, B, 7, s33, 0xf6bb4b60);
+    MD5_STEP_K(HH_SIMD, B, C, D, A, 10, s34, 0xbebfbc70);
+    MD5_STEP_K(HH_SIMD, A, B, C, D, 13, s31, 0x289b7ec6);
+    MD5_STEP_K(HH_SIMD, D, A, B, C, 0, s32, 0xeaa127fa);
+    MD5_STEP_K(HH_SIMD, C, D, A, B, 3, s33, 0xd4ef3085);
+    MD5_STEP_K(HH_SIMD, B, C, D, A, 6, s34, 0x04881d05);
+    MD5_STEP_K(HH_SIMD, A, B, C, D, 9, s31, 0xd9d4d039);
+    MD5_STEP_K(HH_SIMD, D, A, B, C, 12, s32, 0xe6db99e5);
+    MD5_STEP_K(HH_SIMD, C, D, A, B, 15, s33, 0x1fa27cf8);
+    MD5_STEP_K(HH_SIMD, B, C, D, A, 2, s34, 0xc4ac5665);
+
+    // 第4轮操作
+    MD5_STEP_K(II_SIMD, A, B, C, D, 0, s41, 0xf4292244);
+    MD5_STEP_K(II_SIMD, D, A, B, C, 7, s42, 0x432aff97);
+    MD5_STEP_K(II_SIMD, C, D, A, B, 14, s43, 0xab9423a7);
+    MD5_STEP_K(II_SIMD, B, C, D, A, 5, s44, 0xfc93a039);
+    MD5_STEP_K(II_SIMD, A, B, C, D, 12, s41, 0x655b59c3);
+    MD5_STEP_K(II_SIMD, D, A, B, C, 3, s42, 0x8f0ccc92);
+    MD5_STEP_K(II_SIMD, C, D, A, B, 10, s43, 0xffeff47d);
+    MD5_STEP_K(II_SIMD, B, C, D, A, 1, s44, 0x85845dd1);
+    MD5_STEP_K(II_SIMD, A, B, C, D, 8, s41, 0x6fa87e4f);
+    MD5_STEP_K(II_SIMD, D, A, B, C, 15, s42, 0xfe2ce6e0);
+    MD5_STEP_K(II_SIMD, C, D, A, B, 6, s43, 0xa3014314);
+    MD5_STEP_K(II_SIMD, B, C, D, A, 13, s44, 0x4e0811a1);
+    MD5_STEP_K(II_SIMD, A, B, C, D, 4, s41, 0xf7537e82);
+    MD5_STEP_K(II_SIMD, D, A, B, C, 11, s42, 0xbd3af235);
+    MD5_STEP_K(II_SIMD, C, D, A, B, 2, s43, 0x2ad7d2bb);
+    MD5_STEP_K(II_SIMD, B, C, D, A, 9, s44, 0xeb86d391);
+    
+    // 更新状态
+    for (int k = 0; k < K; k++) {
+        a0[k] = vaddq_u32(a0[k], A[k]);
+        b0[k] = vaddq_u32(b0[k], B[k]);
+        c0[k] = vaddq_u32(c0[k], C[k]);
+        d0[k] = vaddq_u32(d0[k], D[k]);
+    }
+}
+
+#undef MD5_STEP_K
+
+// 提取4个通道的最终状态，翻转字节序后写入states（与MD5Hash的输出格式相同）
+static inline void StoreStates_SIMD(bit32x4_t a0, bit32x4_t b0, bit32x4_t c0, bit32x4_t d0, bit32 states[4][4]) {
     // 提取最终哈希值
     bit32 a_values[4], b_values[4], c_values[4], d_values[4];
     vst1q_u32(a_values, a0);
@@ -433,18 +488,1171 @@ void MD5Hash_SIMD(const string inputs[4], bit32 states[4][4]) {
 		 states[i][2] = __builtin_bswap32(c_values[i]);
 		 states[i][3] = __builtin_bswap32(d_values[i]);
 	}
-	
 }
 
+// 4x4转置：输入时r0 ~ r3分别是4个通道各自连续的4个字，输出时r0 ~ r3分别是4个通道的第0 ~ 3个字
+static inline void Transpose4x4_SIMD(bit32x4_t &r0, bit32x4_t &r1, bit32x4_t &r2, bit32x4_t &r3) {
+#if defined(__ARM_NEON) || defined(__aarch64__)
+    uint32x4x2_t t01 = vtrnq_u32(r0, r1); // {a0 b0 a2 b2}, {a1 b1 a3 b3}
+    uint32x4x2_t t23 = vtrnq_u32(r2, r3); // {c0 d0 c2 d2}, {c1 d1 c3 d3}
+    r0 = vcombine_u32(vget_low_u32(t01.val[0]), vget_low_u32(t23.val[0]));
+    r1 = vcombine_u32(vget_low_u32(t01.val[1]), vget_low_u32(t23.val[1]));
+    r2 = vcombine_u32(vget_high_u32(t01.val[0]), vget_high_u32(t23.val[0]));
+    r3 = vcombine_u32(vget_high_u32(t01.val[1]), vget_high_u32(t23.val[1]));
+#else
+    __m128i t0 = _mm_unpacklo_epi32((__m128i)r0, (__m128i)r1); // a0 b0 a1 b1
+    __m128i t1 = _mm_unpacklo_epi32((__m128i)r2, (__m128i)r3); // c0 d0 c1 d1
+    __m128i t2 = _mm_unpackhi_epi32((__m128i)r0, (__m128i)r1); // a2 b2 a3 b3
+    __m128i t3 = _mm_unpackhi_epi32((__m128i)r2, (__m128i)r3); // c2 d2 c3 d3
+    r0 = (bit32x4_t)_mm_unpacklo_epi64(t0, t1);
+    r1 = (bit32x4_t)_mm_unpackhi_epi64(t0, t1);
+    r2 = (bit32x4_t)_mm_unpacklo_epi64(t2, t3);
+    r3 = (bit32x4_t)_mm_unpackhi_epi64(t2, t3);
+#endif
+}
+
+// 读取4个通道各自的前words个字（words为4的倍数，rows[l]处至少有4 * words字节可读），M[j]为4个通道的第j个字
+// 每个通道每次用一条向量指令读入4个字，再经过一次4x4转置，代替每个字4次标量读取
+static inline void LoadWords_SIMD(const Byte *const rows[4], int words, bit32x4_t M[]) {
+    for (int j = 0; j < words; j += 4) {
+        bit32x4_t r0 = vld1q_u32((const bit32 *)(rows[0] + 4 * j));
+        bit32x4_t r1 = vld1q_u32((const bit32 *)(rows[1] + 4 * j));
+        bit32x4_t r2 = vld1q_u32((const bit32 *)(rows[2] + 4 * j));
+        bit32x4_t r3 = vld1q_u32((const bit32 *)(rows[3] + 4 * j));
+        Transpose4x4_SIMD(r0, r1, r2, r3);
+        M[j] = r0;
+        M[j + 1] = r1;
+        M[j + 2] = r2;
+        M[j + 3] = r3;
+    }
+}
+
+// 各通道填充后的消息中第block个块的起始地址
+static inline void BlockRows(Byte *const padded[], int n, int block, const Byte *rows[]) {
+    for (int lane = 0; lane < n; lane++) {
+        rows[lane] = padded[lane] + block * 64;
+    }
+}
+
+void MD5Hash_SIMD(const string inputs[4], bit32 states[4][4]) {
+    const char *ptrs[4] = {inputs[0].data(), inputs[1].data(), inputs[2].data(), inputs[3].data()};
+    size_t lengths[4] = {inputs[0].length(), inputs[1].length(), inputs[2].length(), inputs[3].length()};
+    MD5Hash_SIMD(ptrs, lengths, states);
+}
+
+void MD5Hasher::HashSIMD(const char *const inputs[4], const size_t lengths[4], bit32 states[4][4]) {
+    // 初始状态值
+    bit32x4_t a0 = vdupq_n_u32(0x67452301);
+    bit32x4_t b0 = vdupq_n_u32(0xefcdab89);
+    bit32x4_t c0 = vdupq_n_u32(0x98badcfe);
+    bit32x4_t d0 = vdupq_n_u32(0x10325476);
+    
+    // 为每个字符串准备填充后的数据
+    Byte* paddedMessages[4];
+    int messageLengths[4];
+    
+	// 找出最长的输入
+    size_t max_length = std::max({lengths[0], lengths[1], lengths[2], lengths[3]});
+    
+    // 计算所需的最大缓冲区大小
+    size_t padded_size = ((max_length + 64 + 8 + 63) / 64) * 64; // 确保64字节对齐
+    
+    // 缓冲区属于这个MD5Hasher，在多次调用之间复用
+    Byte *buffer = Scratch(4 * padded_size);
+    
+    for (int i = 0; i < 4; i++) {
+        paddedMessages[i] = buffer + i * padded_size;
+        PrepareMessage(inputs[i], lengths[i], paddedMessages[i], &messageLengths[i]);
+    }
+    
+    // 各通道的块数可以不同：按最多的块数循环，已经处理完自己所有块的通道保持原来的状态
+    // 这些通道读到的是缓冲区中自己消息之后的内容（缓冲区按最长的输入分配，不会越界），计算结果被丢弃
+    bit32 lane_blocks[4] __attribute__((aligned(16)));
+    for (int i = 0; i < 4; i++) {
+        lane_blocks[i] = messageLengths[i] / 64;
+    }
+    int n_blocks = std::max({lane_blocks[0], lane_blocks[1], lane_blocks[2], lane_blocks[3]});
+    bool uniform = lane_blocks[0] == lane_blocks[1] && lane_blocks[1] == lane_blocks[2] && lane_blocks[2] == lane_blocks[3];
+    bit32x4_t blocks_left = vld1q_u32(lane_blocks);
+    bit32x4_t M[16];
+    const Byte *rows[4];
+    
+    // 处理每个块
+    for (int block = 0; block < n_blocks; block++) {
+        BlockRows(paddedMessages, 4, block, rows);
+        LoadWords_SIMD(rows, 16, M);
+        
+        if (uniform) {
+            MD5Block_SIMD(a0, b0, c0, d0, M);
+            continue;
+        }
+        // 只有块数大于block的通道接受这个块的结果
+        bit32x4_t active = vcgtq_u32(blocks_left, vdupq_n_u32(block));
+        bit32x4_t a1 = a0, b1 = b0, c1 = c0, d1 = d0;
+        MD5Block_SIMD(a1, b1, c1, d1, M);
+        a0 = vbslq_u32(active, a1, a0);
+        b0 = vbslq_u32(active, b1, b0);
+        c0 = vbslq_u32(active, c1, c0);
+        d0 = vbslq_u32(active, d1, d0);
+    }
+    
+    StoreStates_SIMD(a0, b0, c0, d0, states);
+}
+
+void MD5Hash_SIMD(const char *const inputs[4], const size_t lengths[4], bit32 states[4][4]) {
+    MD5ThreadHasher().HashSIMD(inputs, lengths, states);
+}
+
+void MD5Hasher::HashSIMD(const char *const inputs[], const size_t lengths[], int count, bit32 states[][4]) {
+    // 不足4个时，空闲的通道重复第一个输入，整组仍然以4路SIMD计算，只输出前count个结果
+    const char *lane_inputs[4];
+    size_t lane_lengths[4];
+    for (int i = 0; i < 4; i++) {
+        lane_inputs[i] = inputs[i < count ? i : 0];
+        lane_lengths[i] = lengths[i < count ? i : 0];
+    }
+    bit32 lane_states[4][4];
+    HashSIMD(lane_inputs, lane_lengths, lane_states);
+    memcpy(states, lane_states, count * sizeof(lane_states[0]));
+}
+
+void MD5Hash_SIMD(const char *const inputs[], const size_t lengths[], int count, bit32 states[][4]) {
+    MD5ThreadHasher().HashSIMD(inputs, lengths, count, states);
+}
+
+void MD5Hash_SIMD_Blocks(const bit32x4_t *words, int n_blocks, bit32 states[4][4]) {
+    bit32x4_t a0 = vdupq_n_u32(0x67452301);
+    bit32x4_t b0 = vdupq_n_u32(0xefcdab89);
+    bit32x4_t c0 = vdupq_n_u32(0x98badcfe);
+    bit32x4_t d0 = vdupq_n_u32(0x10325476);
+
+    // 消息已经按通道交错排列，每个块的16个字直接就是MD5Block_SIMD需要的向量，不需要再收集
+    for (int block = 0; block < n_blocks; block++) {
+        MD5Block_SIMD(a0, b0, c0, d0, words + block * 16);
+    }
+
+    StoreStates_SIMD(a0, b0, c0, d0, states);
+}
+
+void MD5Hash_SIMD_Blocks(const bit32x4_t *words, int n_blocks, bit32 states[4][4], const MD5PrefixState &prefix) {
+    // 前缀部分的结果对4个通道都相同，直接广播
+    bit32x4_t a0 = vdupq_n_u32(prefix.chain[0]);
+    bit32x4_t b0 = vdupq_n_u32(prefix.chain[1]);
+    bit32x4_t c0 = vdupq_n_u32(prefix.chain[2]);
+    bit32x4_t d0 = vdupq_n_u32(prefix.chain[3]);
+
+    // 跳过完全位于前缀中的块，以及下一个块第1轮的前steps步
+    int block = prefix.full_blocks;
+    MD5BlockFrom_SIMD(a0, b0, c0, d0, words + block * 16, prefix.steps,
+                      vdupq_n_u32(prefix.abcd[0]), vdupq_n_u32(prefix.abcd[1]),
+                      vdupq_n_u32(prefix.abcd[2]), vdupq_n_u32(prefix.abcd[3]));
+    for (block += 1; block < n_blocks; block++) {
+        MD5Block_SIMD(a0, b0, c0, d0, words + block * 16);
+    }
+
+    StoreStates_SIMD(a0, b0, c0, d0, states);
+}
+
+// 把n个输入分别填充到h的暂存缓冲区中各自的区域（每个区域按最长的输入分配），padded[i]指向第i个输入填充后的消息
+// lane_blocks[i]为第i个输入的块数，返回其中最大的块数
+static int PrepareLanes(MD5Hasher &h, const char *const inputs[], const size_t lengths[], int n, Byte *padded[], bit32 lane_blocks[]) {
+    size_t max_length = *std::max_element(lengths, lengths + n);
+    size_t padded_size = ((max_length + 64 + 8 + 63) / 64) * 64;
+    Byte *buffer = h.Scratch(n * padded_size);
+    int n_blocks = 0;
+    for (int i = 0; i < n; i++) {
+        padded[i] = buffer + i * padded_size;
+        int length;
+        PrepareMessage(inputs[i], lengths[i], padded[i], &length);
+        lane_blocks[i] = length / 64;
+        n_blocks = max(n_blocks, length / 64);
+    }
+    return n_blocks;
+}
+
+template <int K>
+void MD5Hasher::HashInterleaved(const char *const inputs[], const size_t lengths[], bit32 states[][4]) {
+    const int N = 4 * K;
+    bit32x4_t a0[K], b0[K], c0[K], d0[K];
+    for (int k = 0; k < K; k++) {
+        a0[k] = vdupq_n_u32(0x67452301);
+        b0[k] = vdupq_n_u32(0xefcdab89);
+        c0[k] = vdupq_n_u32(0x98badcfe);
+        d0[k] = vdupq_n_u32(0x10325476);
+    }
+
+    // 与MD5Hash_SIMD相同，每个输入先填充到自己的缓冲区中，缓冲区按最长的输入分配
+    Byte *padded[N];
+    bit32 lane_blocks[N] __attribute__((aligned(16)));
+    int n_blocks = PrepareLanes(*this, inputs, lengths, N, padded, lane_blocks);
+    bool uniform = std::count(lane_blocks, lane_blocks + N, lane_blocks[0]) == N;
+
+    bit32x4_t M[K][16];
+    const Byte *rows[N];
+    for (int block = 0; block < n_blocks; block++) {
+        BlockRows(padded, N, block, rows);
+        for (int k = 0; k < K; k++) {
+            LoadWords_SIMD(rows + 4 * k, 16, M[k]);
+        }
+
+        if (uniform) {
+            MD5BlockInterleaved_SIMD<K>(a0, b0, c0, d0, M);
+            continue;
+        }
+        // 各通道块数不同时，与MD5Hash_SIMD一样只让块数大于block的通道接受这个块的结果
+        bit32x4_t a1[K], b1[K], c1[K], d1[K];
+        for (int k = 0; k < K; k++) {
+            a1[k] = a0[k];
+            b1[k] = b0[k];
+            c1[k] = c0[k];
+            d1[k] = d0[k];
+        }
+        MD5BlockInterleaved_SIMD<K>(a1, b1, c1, d1, M);
+        for (int k = 0; k < K; k++) {
+            bit32x4_t active = vcgtq_u32(vld1q_u32(lane_blocks + 4 * k), vdupq_n_u32(block));
+            a0[k] = vbslq_u32(active, a1[k], a0[k]);
+            b0[k] = vbslq_u32(active, b1[k], b0[k]);
+            c0[k] = vbslq_u32(active, c1[k], c0[k]);
+            d0[k] = vbslq_u32(active, d1[k], d0[k]);
+        }
+    }
+
+    for (int k = 0; k < K; k++) {
+        StoreStates_SIMD(a0[k], b0[k], c0[k], d0[k], &states[4 * k]);
+    }
+}
+
+template <int K>
+void MD5Hash_SIMD_Interleaved(const char *const inputs[], const size_t lengths[], bit32 states[][4]) {
+    MD5ThreadHasher().HashInterleaved<K>(inputs, lengths, states);
+}
+
+// 可以在MD5_INTERLEAVE中选用的交错组数
+template void MD5Hasher::HashInterleaved<1>(const char *const inputs[], const size_t lengths[], bit32 states[][4]);
+template void MD5Hasher::HashInterleaved<2>(const char *const inputs[], const size_t lengths[], bit32 states[][4]);
+template void MD5Hasher::HashInterleaved<3>(const char *const inputs[], const size_t lengths[], bit32 states[][4]);
+template void MD5Hasher::HashInterleaved<4>(const char *const inputs[], const size_t lengths[], bit32 states[][4]);
+template void MD5Hash_SIMD_Interleaved<1>(const char *const inputs[], const size_t lengths[], bit32 states[][4]);
+template void MD5Hash_SIMD_Interleaved<2>(const char *const inputs[], const size_t lengths[], bit32 states[][4]);
+template void MD5Hash_SIMD_Interleaved<3>(const char *const inputs[], const size_t lengths[], bit32 states[][4]);
+template void MD5Hash_SIMD_Interleaved<4>(const char *const inputs[], const size_t lengths[], bit32 states[][4]);
+
+// 单块版本：长度为L（L <= MD5_ONE_BLOCK_MAX）的消息填充后只有一个块
+// 前L / 4个字完全来自消息，第L / 4个字是消息的最后几个字节加上0x80，这些字需要从各输入中读取
+// 其余的字都是编译期常量：第14个字为消息的比特长度，其余为0，与加法常数合并之后不再需要单独的加法
+constexpr int OneBlockLoadedWords(int L) { return L / 4 + 1; }
+constexpr bit32 OneBlockConstWord(int L, int j) { return j == 14 ? L * 8 : 0; }
+
+// 按行向量读取时实际读入的字数（补齐到4的倍数）
+constexpr int OneBlockRowWords(int L) { return (OneBlockLoadedWords(L) + 3) / 4 * 4; }
+
+// 把长度为L的消息p复制到64字节的slot中，加上0x80并把最后一个需要读取的字补齐
+// 之后就可以对每个通道整行地向量读取再转置，不会读到输入之外的内存；L是编译期常量，复制会被展开成几条定长的读写
+template <int L>
+static inline const Byte *OneBlockFill(const char *p, Byte *slot) {
+    memcpy(slot, p, L);
+    slot[L] = 0x80;
+    memset(slot + L + 1, 0, 4 * OneBlockLoadedWords(L) - L - 1);
+    return slot;
+}
+
+// 第k步（1 ~ 64）使用的字的下标，与MD5_ROUNDS中的j相同
+constexpr int MD5StepWord(int k) {
+    return k <= 16 ? k - 1 : k <= 32 ? (1 + 5 * (k - 17)) % 16 : k <= 48 ? (5 + 3 * (k - 33)) % 16 : 7 * (k - 49) % 16;
+}
+// 从第64步往前，第一个使用消息中可变的字（前OneBlockLoadedWords(L)个字）的步数
+// 这一步之后的各步只使用常数字，对单个目标可以从目标的结果反向算出这些步之前的状态
+constexpr int OneBlockExitStep(int L) {
+    int k = 64;
+    while (MD5StepWord(k) >= OneBlockLoadedWords(L)) {
+        k--;
+    }
+    return k;
+}
+
+// 4个通道中是否有非零的
+static inline bool AnyLane_SIMD(bit32x4_t m) {
+#if defined(__ARM_NEON) || defined(__aarch64__)
+    uint32x2_t r = vorr_u32(vget_low_u32(m), vget_high_u32(m));
+    return (vget_lane_u32(r, 0) | vget_lane_u32(r, 1)) != 0;
+#else
+    return _mm_movemask_epi8((__m128i)m) != 0;
+#endif
+}
+
+// 单块版本在刚完成第step步（更新的寄存器为a）之后与match比较，返回false表示所有通道都不可能是目标
+// step和L都是编译期常量，只有下面两个比较点会留下代码：
+// 单个目标时在第OneBlockExitStep(L) - 4步之后，a应为match.reverse[L]减去第OneBlockExitStep(L)步使用的字（之后的4步都不会再改变a）
+// 多个目标时在第61步之后，a即最终的A寄存器，与每个目标的final_a比较
+template <int L, int K>
+static inline bool OneBlockMayMatch_SIMD(const MD5SmallTargetSet &match, int step, const bit32x4_t a[K], const bit32x4_t M[K][16]) {
+    bit32x4_t hit = vdupq_n_u32(0);
+    if (step == OneBlockExitStep(L) - 4 && match.count == 1) {
+        bit32x4_t expected = vdupq_n_u32(match.reverse[L]);
+        for (int k = 0; k < K; k++) {
+            hit = vorrq_u32(hit, vceqq_u32(a[k], vsubq_u32(expected, M[k][MD5StepWord(OneBlockExitStep(L))])));
+        }
+    } else if (step == 61 && match.count > 1) {
+        for (int i = 0; i < match.count; i++) {
+            bit32x4_t target = vdupq_n_u32(match.final_a[i]);
+            for (int k = 0; k < K; k++) {
+                hit = vorrq_u32(hit, vceqq_u32(a[k], target));
+            }
+        }
+    } else {
+        return true;
+    }
+    return AnyLane_SIMD(hit);
+}
+
+// 单块版本中第j个字加上这一步的常数ac：j和L都是编译期常量，条件在编译时就能确定
+// 每一步之后检查是否可以提前结束，step同样在编译时就能确定
+#define ONE_BLOCK_WORD_SIMD(j, ac) \
+    ((j) < OneBlockLoadedWords(L) ? vaddq_u32(M[k][j], vdupq_n_u32(ac)) : vdupq_n_u32(OneBlockConstWord(L, j) + (ac)))
+#define STEP_ONE_BLOCK_SIMD(f, a, b, c, d, j, s, ac) \
+    for (int k = 0; k < K; k++) { \
+        a[k] = vaddq_u32(a[k], vaddq_u32(f##_SIMD(b[k], c[k], d[k]), ONE_BLOCK_WORD_SIMD(j, ac))); \
+        a[k] = vaddq_u32(ROTATELEFT_SIMD(a[k], s), b[k]); \
+    } \
+    step += 1; \
+    if (match != nullptr && !OneBlockMayMatch_SIMD<L, K>(*match, step, a, M)) { \
+        return false; \
+    }
+
+// 4 * K个长度都为L的输入，K组4通道状态交错执行（与MD5Hash_SIMD_Interleaved相同）
+template <int L, int K>
+static bool MD5OneBlock_SIMD(const char *const inputs[], Byte *slots, const MD5SmallTargetSet *match, bit32 states[][4]) {
+    const Byte *rows[4 * K];
+    for (int lane = 0; lane < 4 * K; lane++) {
+        rows[lane] = OneBlockFill<L>(inputs[lane], slots + lane * 64);
+    }
+    bit32x4_t M[K][16];
+    for (int k = 0; k < K; k++) {
+        LoadWords_SIMD(rows + 4 * k, OneBlockRowWords(L), M[k]);
+    }
+
+    bit32x4_t A[K], B[K], C[K], D[K];
+    for (int k = 0; k < K; k++) {
+        A[k] = vdupq_n_u32(0x67452301);
+        B[k] = vdupq_n_u32(0xefcdab89);
+        C[k] = vdupq_n_u32(0x98badcfe);
+        D[k] = vdupq_n_u32(0x10325476);
+    }
+    int step = 0;
+    MD5_ROUNDS(STEP_ONE_BLOCK_SIMD)
+    for (int k = 0; k < K; k++) {
+        StoreStates_SIMD(vaddq_u32(A[k], vdupq_n_u32(0x67452301)), vaddq_u32(B[k], vdupq_n_u32(0xefcdab89)),
+                         vaddq_u32(C[k], vdupq_n_u32(0x98badcfe)), vaddq_u32(D[k], vdupq_n_u32(0x10325476)), &states[4 * k]);
+    }
+    return true;
+}
+
+// 各后端的单块版本按长度0 ~ MD5_ONE_BLOCK_MAX排成的函数表，slots为每个通道64字节的暂存空间
+// match不为空且所有通道都不可能是目标时提前返回false，不写入states
+typedef bool (*OneBlockFn)(const char *const inputs[], Byte *slots, const MD5SmallTargetSet *match, bit32 states[][4]);
+#define ONE_BLOCK_LENGTHS_8(kernel, base, ...) \
+    &kernel<base, ##__VA_ARGS__>, &kernel<base + 1, ##__VA_ARGS__>, &kernel<base + 2, ##__VA_ARGS__>, &kernel<base + 3, ##__VA_ARGS__>, \
+    &kernel<base + 4, ##__VA_ARGS__>, &kernel<base + 5, ##__VA_ARGS__>, &kernel<base + 6, ##__VA_ARGS__>, &kernel<base + 7, ##__VA_ARGS__>
+#define ONE_BLOCK_TABLE(kernel, ...) { \
+    ONE_BLOCK_LENGTHS_8(kernel, 0, ##__VA_ARGS__), ONE_BLOCK_LENGTHS_8(kernel, 8, ##__VA_ARGS__), \
+    ONE_BLOCK_LENGTHS_8(kernel, 16, ##__VA_ARGS__), ONE_BLOCK_LENGTHS_8(kernel, 24, ##__VA_ARGS__), \
+    ONE_BLOCK_LENGTHS_8(kernel, 32, ##__VA_ARGS__), ONE_BLOCK_LENGTHS_8(kernel, 40, ##__VA_ARGS__), \
+    ONE_BLOCK_LENGTHS_8(kernel, 48, ##__VA_ARGS__) }
+
+static const OneBlockFn one_block_simd[MD5_ONE_BLOCK_MAX + 1] = ONE_BLOCK_TABLE(MD5OneBlock_SIMD, MD5_INTERLEAVE);
+
 void MD5Hash_SIMD8(const string inputs[8], bit32 states[8][4]) {
-    // 顺序处理8个输入，避免线程创建开销
-    MD5Hash_SIMD(&inputs[0], &states[0]);
-    MD5Hash_SIMD(&inputs[4], &states[4]);
+    // 两组4通道状态交错执行
+    const char *ptrs[8];
+    size_t lengths[8];
+    for (int i = 0; i < 8; i++) {
+        ptrs[i] = inputs[i].data();
+        lengths[i] = inputs[i].length();
+    }
+    MD5Hash_SIMD_Interleaved<2>(ptrs, lengths, states);
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// AVX2版本：8个通道，各函数只用AVX2指令；下面的函数都带有target属性，不需要额外的编译选项，运行时确认CPU支持之后才会调用
+#define F_AVX2(x, y, z) _mm256_or_si256(_mm256_and_si256((x), (y)), _mm256_andnot_si256((x), (z)))
+#define G_AVX2(x, y, z) _mm256_or_si256(_mm256_and_si256((x), (z)), _mm256_andnot_si256((z), (y)))
+#define H_AVX2(x, y, z) _mm256_xor_si256(_mm256_xor_si256((x), (y)), (z))
+#define I_AVX2(x, y, z) _mm256_xor_si256((y), _mm256_or_si256((x), _mm256_xor_si256((z), _mm256_set1_epi32(-1))))
+#define STEP_AVX2(f, a, b, c, d, j, s, ac) \
+    a = _mm256_add_epi32(a, _mm256_add_epi32(f##_AVX2(b, c, d), _mm256_add_epi32(M[j], _mm256_set1_epi32((int)(ac))))); \
+    a = _mm256_add_epi32(_mm256_or_si256(_mm256_slli_epi32(a, s), _mm256_srli_epi32(a, 32 - (s))), b);
+
+// 与LoadWords_SIMD相同：第l和第l + 4个通道的4个字放在同一个寄存器的低、高128位，在两半中同时做4x4转置
+__attribute__((target("avx2")))
+static inline void LoadWords_AVX2(const Byte *const rows[8], int words, __m256i M[]) {
+    for (int j = 0; j < words; j += 4) {
+        __m256i r[4];
+        for (int i = 0; i < 4; i++) {
+            r[i] = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(rows[i] + 4 * j))),
+                                           _mm_loadu_si128((const __m128i *)(rows[i + 4] + 4 * j)), 1);
+        }
+        __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+        __m256i t1 = _mm256_unpacklo_epi32(r[2], r[3]);
+        __m256i t2 = _mm256_unpackhi_epi32(r[0], r[1]);
+        __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+        M[j] = _mm256_unpacklo_epi64(t0, t1);
+        M[j + 1] = _mm256_unpackhi_epi64(t0, t1);
+        M[j + 2] = _mm256_unpacklo_epi64(t2, t3);
+        M[j + 3] = _mm256_unpackhi_epi64(t2, t3);
+    }
+}
+
+__attribute__((target("avx2")))
+static void MD5Block_AVX2(__m256i state[4], const __m256i M[16]) {
+    __m256i A = state[0], B = state[1], C = state[2], D = state[3];
+    MD5_ROUNDS(STEP_AVX2)
+    state[0] = _mm256_add_epi32(state[0], A);
+    state[1] = _mm256_add_epi32(state[1], B);
+    state[2] = _mm256_add_epi32(state[2], C);
+    state[3] = _mm256_add_epi32(state[3], D);
+}
+
+__attribute__((target("avx2")))
+static void MD5Hash_AVX2(MD5Hasher &h, const char *const inputs[8], const size_t lengths[8], bit32 states[8][4]) {
+    Byte *padded[8];
+    bit32 lane_blocks[8] __attribute__((aligned(32)));
+    int n_blocks = PrepareLanes(h, inputs, lengths, 8, padded, lane_blocks);
+    __m256i blocks_left = _mm256_load_si256((const __m256i *)lane_blocks);
+
+    __m256i state[4] = {_mm256_set1_epi32(0x67452301), _mm256_set1_epi32((int)0xefcdab89),
+                        _mm256_set1_epi32((int)0x98badcfe), _mm256_set1_epi32(0x10325476)};
+    __m256i M[16];
+    const Byte *rows[8];
+    for (int block = 0; block < n_blocks; block++) {
+        BlockRows(padded, 8, block, rows);
+        LoadWords_AVX2(rows, 16, M);
+        __m256i next[4] = {state[0], state[1], state[2], state[3]};
+        MD5Block_AVX2(next, M);
+        // 只有块数大于block的通道接受这个块的结果（块数很小，可以直接用有符号比较）
+        __m256i active = _mm256_cmpgt_epi32(blocks_left, _mm256_set1_epi32(block));
+        for (int i = 0; i < 4; i++) {
+            state[i] = _mm256_blendv_epi8(state[i], next[i], active);
+        }
+    }
+
+    bit32 out[4][8] __attribute__((aligned(32)));
+    for (int i = 0; i < 4; i++) {
+        _mm256_store_si256((__m256i *)out[i], state[i]);
+    }
+    for (int lane = 0; lane < 8; lane++) {
+        for (int i = 0; i < 4; i++) {
+            states[lane][i] = __builtin_bswap32(out[i][lane]);
+        }
+    }
+}
+
+// AVX-512版本：16个通道，循环移位用vprold，F/G/H/I各用一条vpternlogd（立即数为对应布尔函数的真值表）
+// 循环移位写成全部通道都选中的mask版本，与_mm512_rol_epi32是同一条指令，但是不会触发GCC 12对_mm512_undefined_epi32的误报
+#define F_AVX512(x, y, z) _mm512_ternarylogic_epi32((x), (y), (z), 0xca)
+#define G_AVX512(x, y, z) _mm512_ternarylogic_epi32((x), (y), (z), 0xe4)
+#define H_AVX512(x, y, z) _mm512_ternarylogic_epi32((x), (y), (z), 0x96)
+#define I_AVX512(x, y, z) _mm512_ternarylogic_epi32((x), (y), (z), 0x39)
+#define STEP_AVX512(f, a, b, c, d, j, s, ac) \
+    a = _mm512_add_epi32(a, _mm512_add_epi32(f##_AVX512(b, c, d), _mm512_add_epi32(M[j], _mm512_set1_epi32((int)(ac))))); \
+    a = _mm512_add_epi32(_mm512_mask_rol_epi32(a, 0xffff, a, s), b);
+
+// 第l、l + 4、l + 8、l + 12个通道的4个字分别放在同一个寄存器的4个128位中，在4个128位中同时做4x4转置
+__attribute__((target("avx512f")))
+static inline void LoadWords_AVX512(const Byte *const rows[16], int words, __m512i M[]) {
+    for (int j = 0; j < words; j += 4) {
+        __m512i r[4];
+        for (int i = 0; i < 4; i++) {
+            r[i] = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i *)(rows[i] + 4 * j)));
+            r[i] = _mm512_inserti32x4(r[i], _mm_loadu_si128((const __m128i *)(rows[i + 4] + 4 * j)), 1);
+            r[i] = _mm512_inserti32x4(r[i], _mm_loadu_si128((const __m128i *)(rows[i + 8] + 4 * j)), 2);
+            r[i] = _mm512_inserti32x4(r[i], _mm_loadu_si128((const __m128i *)(rows[i + 12] + 4 * j)), 3);
+        }
+        // 与循环移位相同，写成全部通道都选中的mask版本，避免GCC 12的误报
+        __m512i t0 = _mm512_mask_unpacklo_epi32(r[0], 0xffff, r[0], r[1]);
+        __m512i t1 = _mm512_mask_unpacklo_epi32(r[2], 0xffff, r[2], r[3]);
+        __m512i t2 = _mm512_mask_unpackhi_epi32(r[0], 0xffff, r[0], r[1]);
+        __m512i t3 = _mm512_mask_unpackhi_epi32(r[2], 0xffff, r[2], r[3]);
+        M[j] = _mm512_mask_unpacklo_epi64(t0, 0xff, t0, t1);
+        M[j + 1] = _mm512_mask_unpackhi_epi64(t0, 0xff, t0, t1);
+        M[j + 2] = _mm512_mask_unpacklo_epi64(t2, 0xff, t2, t3);
+        M[j + 3] = _mm512_mask_unpackhi_epi64(t2, 0xff, t2, t3);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void MD5Block_AVX512(__m512i state[4], const __m512i M[16]) {
+    __m512i A = state[0], B = state[1], C = state[2], D = state[3];
+    MD5_ROUNDS(STEP_AVX512)
+    state[0] = _mm512_add_epi32(state[0], A);
+    state[1] = _mm512_add_epi32(state[1], B);
+    state[2] = _mm512_add_epi32(state[2], C);
+    state[3] = _mm512_add_epi32(state[3], D);
+}
+
+__attribute__((target("avx512f")))
+static void MD5Hash_AVX512(MD5Hasher &h, const char *const inputs[16], const size_t lengths[16], bit32 states[16][4]) {
+    Byte *padded[16];
+    bit32 lane_blocks[16] __attribute__((aligned(64)));
+    int n_blocks = PrepareLanes(h, inputs, lengths, 16, padded, lane_blocks);
+    __m512i blocks_left = _mm512_load_si512(lane_blocks);
+
+    __m512i state[4] = {_mm512_set1_epi32(0x67452301), _mm512_set1_epi32((int)0xefcdab89),
+                        _mm512_set1_epi32((int)0x98badcfe), _mm512_set1_epi32(0x10325476)};
+    __m512i M[16];
+    const Byte *rows[16];
+    for (int block = 0; block < n_blocks; block++) {
+        BlockRows(padded, 16, block, rows);
+        LoadWords_AVX512(rows, 16, M);
+        __m512i next[4] = {state[0], state[1], state[2], state[3]};
+        MD5Block_AVX512(next, M);
+        // 用掩码寄存器只更新块数大于block的通道
+        __mmask16 active = _mm512_cmpgt_epi32_mask(blocks_left, _mm512_set1_epi32(block));
+        for (int i = 0; i < 4; i++) {
+            state[i] = _mm512_mask_mov_epi32(state[i], active, next[i]);
+        }
+    }
+
+    bit32 out[4][16] __attribute__((aligned(64)));
+    for (int i = 0; i < 4; i++) {
+        _mm512_store_si512(out[i], state[i]);
+    }
+    for (int lane = 0; lane < 16; lane++) {
+        for (int i = 0; i < 4; i++) {
+            states[lane][i] = __builtin_bswap32(out[i][lane]);
+        }
+    }
+}
+
+// AVX2、AVX-512的单块版本，与MD5OneBlock_SIMD相同
+template <int L>
+__attribute__((target("avx2")))
+static inline bool OneBlockMayMatch_AVX2(const MD5SmallTargetSet &match, int step, __m256i a, const __m256i M[16]) {
+    __m256i hit = _mm256_setzero_si256();
+    if (step == OneBlockExitStep(L) - 4 && match.count == 1) {
+        hit = _mm256_cmpeq_epi32(a, _mm256_sub_epi32(_mm256_set1_epi32((int)match.reverse[L]), M[MD5StepWord(OneBlockExitStep(L))]));
+    } else if (step == 61 && match.count > 1) {
+        for (int i = 0; i < match.count; i++) {
+            hit = _mm256_or_si256(hit, _mm256_cmpeq_epi32(a, _mm256_set1_epi32((int)match.final_a[i])));
+        }
+    } else {
+        return true;
+    }
+    return !_mm256_testz_si256(hit, hit);
+}
+
+#define STEP_ONE_BLOCK_AVX2(f, a, b, c, d, j, s, ac) \
+    a = _mm256_add_epi32(a, _mm256_add_epi32(f##_AVX2(b, c, d), (j) < OneBlockLoadedWords(L) \
+        ? _mm256_add_epi32(M[j], _mm256_set1_epi32((int)(ac))) : _mm256_set1_epi32((int)(OneBlockConstWord(L, j) + (ac))))); \
+    a = _mm256_add_epi32(_mm256_or_si256(_mm256_slli_epi32(a, s), _mm256_srli_epi32(a, 32 - (s))), b); \
+    step += 1; \
+    if (match != nullptr && !OneBlockMayMatch_AVX2<L>(*match, step, a, M)) { \
+        return false; \
+    }
+
+template <int L>
+__attribute__((target("avx2")))
+static bool MD5OneBlock_AVX2(const char *const inputs[], Byte *slots, const MD5SmallTargetSet *match, bit32 states[][4]) {
+    const Byte *rows[8];
+    for (int lane = 0; lane < 8; lane++) {
+        rows[lane] = OneBlockFill<L>(inputs[lane], slots + lane * 64);
+    }
+    __m256i M[16];
+    LoadWords_AVX2(rows, OneBlockRowWords(L), M);
+
+    __m256i A = _mm256_set1_epi32(0x67452301), B = _mm256_set1_epi32((int)0xefcdab89);
+    __m256i C = _mm256_set1_epi32((int)0x98badcfe), D = _mm256_set1_epi32(0x10325476);
+    int step = 0;
+    MD5_ROUNDS(STEP_ONE_BLOCK_AVX2)
+
+    bit32 out[4][8] __attribute__((aligned(32)));
+    _mm256_store_si256((__m256i *)out[0], _mm256_add_epi32(A, _mm256_set1_epi32(0x67452301)));
+    _mm256_store_si256((__m256i *)out[1], _mm256_add_epi32(B, _mm256_set1_epi32((int)0xefcdab89)));
+    _mm256_store_si256((__m256i *)out[2], _mm256_add_epi32(C, _mm256_set1_epi32((int)0x98badcfe)));
+    _mm256_store_si256((__m256i *)out[3], _mm256_add_epi32(D, _mm256_set1_epi32(0x10325476)));
+    for (int lane = 0; lane < 8; lane++) {
+        for (int i = 0; i < 4; i++) {
+            states[lane][i] = __builtin_bswap32(out[i][lane]);
+        }
+    }
+    return true;
+}
+
+template <int L>
+__attribute__((target("avx512f")))
+static inline bool OneBlockMayMatch_AVX512(const MD5SmallTargetSet &match, int step, __m512i a, const __m512i M[16]) {
+    __mmask16 hit = 0;
+    if (step == OneBlockExitStep(L) - 4 && match.count == 1) {
+        hit = _mm512_cmpeq_epi32_mask(a, _mm512_sub_epi32(_mm512_set1_epi32((int)match.reverse[L]), M[MD5StepWord(OneBlockExitStep(L))]));
+    } else if (step == 61 && match.count > 1) {
+        for (int i = 0; i < match.count; i++) {
+            hit |= _mm512_cmpeq_epi32_mask(a, _mm512_set1_epi32((int)match.final_a[i]));
+        }
+    } else {
+        return true;
+    }
+    return hit != 0;
+}
+
+#define STEP_ONE_BLOCK_AVX512(f, a, b, c, d, j, s, ac) \
+    a = _mm512_add_epi32(a, _mm512_add_epi32(f##_AVX512(b, c, d), (j) < OneBlockLoadedWords(L) \
+        ? _mm512_add_epi32(M[j], _mm512_set1_epi32((int)(ac))) : _mm512_set1_epi32((int)(OneBlockConstWord(L, j) + (ac))))); \
+    a = _mm512_add_epi32(_mm512_mask_rol_epi32(a, 0xffff, a, s), b); \
+    step += 1; \
+    if (match != nullptr && !OneBlockMayMatch_AVX512<L>(*match, step, a, M)) { \
+        return false; \
+    }
+
+template <int L>
+__attribute__((target("avx512f")))
+static bool MD5OneBlock_AVX512(const char *const inputs[], Byte *slots, const MD5SmallTargetSet *match, bit32 states[][4]) {
+    const Byte *rows[16];
+    for (int lane = 0; lane < 16; lane++) {
+        rows[lane] = OneBlockFill<L>(inputs[lane], slots + lane * 64);
+    }
+    __m512i M[16];
+    LoadWords_AVX512(rows, OneBlockRowWords(L), M);
+
+    __m512i A = _mm512_set1_epi32(0x67452301), B = _mm512_set1_epi32((int)0xefcdab89);
+    __m512i C = _mm512_set1_epi32((int)0x98badcfe), D = _mm512_set1_epi32(0x10325476);
+    int step = 0;
+    MD5_ROUNDS(STEP_ONE_BLOCK_AVX512)
+
+    bit32 out[4][16] __attribute__((aligned(64)));
+    _mm512_store_si512(out[0], _mm512_add_epi32(A, _mm512_set1_epi32(0x67452301)));
+    _mm512_store_si512(out[1], _mm512_add_epi32(B, _mm512_set1_epi32((int)0xefcdab89)));
+    _mm512_store_si512(out[2], _mm512_add_epi32(C, _mm512_set1_epi32((int)0x98badcfe)));
+    _mm512_store_si512(out[3], _mm512_add_epi32(D, _mm512_set1_epi32(0x10325476)));
+    for (int lane = 0; lane < 16; lane++) {
+        for (int i = 0; i < 4; i++) {
+            states[lane][i] = __builtin_bswap32(out[i][lane]);
+        }
+    }
+    return true;
+}
+
+static const OneBlockFn one_block_avx2[MD5_ONE_BLOCK_MAX + 1] = ONE_BLOCK_TABLE(MD5OneBlock_AVX2);
+static const OneBlockFn one_block_avx512[MD5_ONE_BLOCK_MAX + 1] = ONE_BLOCK_TABLE(MD5OneBlock_AVX512);
+#endif
+
+const char *MD5BackendName(MD5Backend backend) {
+    switch (backend) {
+    case MD5_BACKEND_NEON:
+        return "NEON";
+    case MD5_BACKEND_SSE2:
+        return "SSE2";
+    case MD5_BACKEND_AVX2:
+        return "AVX2";
+    case MD5_BACKEND_AVX512:
+        return "AVX-512";
+    }
+    return "unknown";
+}
+
+bool MD5BackendSupported(MD5Backend backend) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    switch (backend) {
+    case MD5_BACKEND_SSE2:
+        return true;
+    case MD5_BACKEND_AVX2:
+        return __builtin_cpu_supports("avx2");
+    case MD5_BACKEND_AVX512:
+        return __builtin_cpu_supports("avx512f");
+    default:
+        return false;
+    }
+#else
+    return backend == MD5_BACKEND_NEON;
+#endif
+}
+
+// 当前使用的后端，第一次使用时选择CPU支持的最宽的后端
+// 哈希线程可能在MD5UseBackend修改它的同时读取，因此使用原子变量；每个MD5Hasher在一次调用中只使用自己记录的后端
+static atomic<MD5Backend> &CurrentBackend() {
+    static atomic<MD5Backend> backend(([] {
+        for (MD5Backend b : {MD5_BACKEND_AVX512, MD5_BACKEND_AVX2, MD5_BACKEND_SSE2}) {
+            if (MD5BackendSupported(b)) {
+                return b;
+            }
+        }
+        return MD5_BACKEND_NEON;
+    })());
+    return backend;
+}
+
+MD5Backend MD5CurrentBackend() {
+    return CurrentBackend().load(memory_order_relaxed);
+}
+
+bool MD5UseBackend(MD5Backend backend) {
+    if (!MD5BackendSupported(backend)) {
+        return false;
+    }
+    CurrentBackend().store(backend, memory_order_relaxed);
+    return true;
+}
+
+// 后端一次哈希的输入个数
+static int BackendWidth(MD5Backend backend) {
+    switch (backend) {
+    case MD5_BACKEND_AVX2:
+        return 8;
+    case MD5_BACKEND_AVX512:
+        return 16;
+    default:
+        return 4 * MD5_INTERLEAVE;
+    }
+}
+
+int MD5BackendWidth() {
+    return BackendWidth(MD5CurrentBackend());
+}
+
+MD5Hasher::MD5Hasher() {
+    UseBackend(MD5CurrentBackend());
+}
+
+bool MD5Hasher::UseBackend(MD5Backend new_backend) {
+    if (!MD5BackendSupported(new_backend)) {
+        return false;
+    }
+    backend = new_backend;
+    backend_width = BackendWidth(new_backend);
+    return true;
+}
+
+void MD5Hasher::HashWide(const char *const inputs[], const size_t lengths[], bit32 states[][4]) {
+    // 长度都相同且只有一个块时，改用对应长度的单块版本
+    int width = backend_width;
+    if (lengths[0] <= MD5_ONE_BLOCK_MAX && std::count(lengths, lengths + width, lengths[0]) == width) {
+        HashOneBlock(lengths[0], inputs, states);
+        return;
+    }
+    switch (backend) {
+#if defined(__x86_64__) || defined(__i386__)
+    case MD5_BACKEND_AVX2:
+        MD5Hash_AVX2(*this, inputs, lengths, states);
+        return;
+    case MD5_BACKEND_AVX512:
+        MD5Hash_AVX512(*this, inputs, lengths, states);
+        return;
+#endif
+    default:
+        HashInterleaved<MD5_INTERLEAVE>(inputs, lengths, states);
+        return;
+    }
 }
 
+void MD5Hash_Wide(const char *const inputs[], const size_t lengths[], bit32 states[][4]) {
+    MD5ThreadHasher().HashWide(inputs, lengths, states);
+}
+
+bool MD5Hasher::HashOneBlock(int length, const char *const inputs[], bit32 states[][4], const MD5SmallTargetSet *match) {
+    Byte *slots = Scratch(16 * 64);
+    switch (backend) {
+#if defined(__x86_64__) || defined(__i386__)
+    case MD5_BACKEND_AVX2:
+        return one_block_avx2[length](inputs, slots, match, states);
+    case MD5_BACKEND_AVX512:
+        return one_block_avx512[length](inputs, slots, match, states);
+#endif
+    default:
+        return one_block_simd[length](inputs, slots, match, states);
+    }
+}
+
+void MD5Hash_WideOneBlock(int length, const char *const inputs[], bit32 states[][4]) {
+    MD5ThreadHasher().HashOneBlock(length, inputs, states);
+}
+
+// 第index个输入的结果：match为空时写入out，否则只在结果属于match时把index追加到hits中
+static inline void EmitDigest(size_t index, const bit32 state[4], MD5Digest *out, const MD5SmallTargetSet *match, vector<size_t> *hits) {
+    if (match == nullptr) {
+        memcpy(out[index].state, state, sizeof(out[index].state));
+    } else if (match->contains(state)) {
+        hits->push_back(index);
+    }
+}
+
+// 把order中的一组输入（下标）4个一组交给MD5Hash_SIMD，结果按下标交给EmitDigest
+static void HashIndexed_SIMD(MD5Hasher &h, const uint8_t *const *ptrs, const uint32_t *lens, const size_t *order, size_t n,
+                             MD5Digest *out, const MD5SmallTargetSet *match, vector<size_t> *hits) {
+    const char *group_inputs[4];
+    size_t group_lengths[4];
+    bit32 states[4][4];
+    for (size_t i = 0; i < n; i += 4) {
+        int count = min<size_t>(4, n - i);
+        for (int lane = 0; lane < count; lane++) {
+            group_inputs[lane] = (const char *)ptrs[order[i + lane]];
+            group_lengths[lane] = lens[order[i + lane]];
+        }
+        h.HashSIMD(group_inputs, group_lengths, count, states);
+        for (int lane = 0; lane < count; lane++) {
+            EmitDigest(order[i + lane], states[lane], out, match, hits);
+        }
+    }
+}
+
+// 同上，但是每次取h.Width()个输入交给h的后端，n必须是h.Width()的倍数
+// length >= 0时，这些输入的长度都是length（不超过MD5_ONE_BLOCK_MAX），使用单块版本，单块版本确定整组都不是目标时直接跳过这一组
+static void HashIndexed_Wide(MD5Hasher &h, const uint8_t *const *ptrs, const uint32_t *lens, const size_t *order, size_t n, int length,
+                             MD5Digest *out, const MD5SmallTargetSet *match, vector<size_t> *hits) {
+    const int N = h.Width();
+    const char *group_inputs[16];
+    size_t group_lengths[16];
+    bit32 states[16][4];
+    for (size_t i = 0; i < n; i += N) {
+        for (int lane = 0; lane < N; lane++) {
+            group_inputs[lane] = (const char *)ptrs[order[i + lane]];
+            group_lengths[lane] = lens[order[i + lane]];
+        }
+        if (length >= 0) {
+            if (!h.HashOneBlock(length, group_inputs, states, match)) {
+                continue;
+            }
+        } else {
+            h.HashWide(group_inputs, group_lengths, states);
+        }
+        for (int lane = 0; lane < N; lane++) {
+            EmitDigest(order[i + lane], states[lane], out, match, hits);
+        }
+    }
+}
+
+// 分桶的键：只有一个块的输入按确切的长度分桶，交给对应长度的单块版本；更长的输入按块数分桶
+static inline size_t BucketKey(size_t length) {
+    return length <= MD5_ONE_BLOCK_MAX ? length : MD5_ONE_BLOCK_MAX + (length + 8) / 64;
+}
+
+void MD5Hasher::HashBuckets(const uint8_t *const *ptrs, const uint32_t *lens, size_t n, MD5Digest *out,
+                            const MD5SmallTargetSet *match, vector<size_t> *hits) {
+    // 计数排序：order中的下标按键分段，同一段内保持原来的生成顺序
+    size_t max_key = 0;
+    for (size_t i = 0; i < n; i++) {
+        max_key = max(max_key, BucketKey(lens[i]));
+    }
+    bucket_start.assign(max_key + 2, 0);
+    for (size_t i = 0; i < n; i++) {
+        bucket_start[BucketKey(lens[i]) + 1] += 1;
+    }
+    for (size_t b = 1; b < bucket_start.size(); b++) {
+        bucket_start[b] += bucket_start[b - 1];
+    }
+    order.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        order[bucket_start[BucketKey(lens[i])]++] = i;
+    }
+
+    // 此时bucket_start[b]是键为b的桶的结尾（也就是键为b + 1的桶的开头）
+    // 整个批次都使用同一个后端，分组的大小与交给HashIndexed_Wide的后端一致
+    size_t width = backend_width;
+    leftovers.clear();
+    size_t begin = 0;
+    for (size_t b = 0; b <= max_key; b++) {
+        size_t end = bucket_start[b];
+        size_t full = (end - begin) / width * width;
+        HashIndexed_Wide(*this, ptrs, lens, &order[begin], full, b <= MD5_ONE_BLOCK_MAX ? (int)b : -1, out, match, hits);
+        leftovers.insert(leftovers.end(), order.begin() + begin + full, order.begin() + end);
+        begin = end;
+    }
+    // 各桶剩下的输入长度不同，由MD5Hash_SIMD的通道掩码处理
+    HashIndexed_SIMD(*this, ptrs, lens, leftovers.data(), leftovers.size(), out, match, hits);
+}
+
+void MD5Hasher::HashBatch(const uint8_t *const *ptrs, const uint32_t *lens, size_t n, MD5Digest *out) {
+    HashBuckets(ptrs, lens, n, out, nullptr, nullptr);
+}
+
+void MD5Hasher::MatchBatch(const uint8_t *const *ptrs, const uint32_t *lens, size_t n, const MD5SmallTargetSet &targets, vector<size_t> &hits) {
+    // 分桶打乱了顺序，命中的下标（通常很少）最后再排序
+    size_t first = hits.size();
+    HashBuckets(ptrs, lens, n, nullptr, &targets, &hits);
+    sort(hits.begin() + first, hits.end());
+}
+
+void MD5Hash_Batch(const uint8_t *const *ptrs, const uint32_t *lens, size_t n, MD5Digest *out) {
+    MD5ThreadHasher().HashBatch(ptrs, lens, n, out);
+}
+
+void MD5Match_Batch(const uint8_t *const *ptrs, const uint32_t *lens, size_t n, const MD5SmallTargetSet &targets, vector<size_t> &hits) {
+    MD5ThreadHasher().MatchBatch(ptrs, lens, n, targets, hits);
+}
+
+MD5Hasher::~MD5Hasher() {
+    ::operator delete(scratch, std::align_val_t(64));
+}
+
+Byte *MD5Hasher::Scratch(size_t size) {
+    if (size > scratch_capacity) {
+        ::operator delete(scratch, std::align_val_t(64));
+        scratch_capacity = max(size, 2 * scratch_capacity);
+        scratch = (Byte *)::operator new(scratch_capacity, std::align_val_t(64));
+    }
+    return scratch;
+}
+
+MD5Hasher &MD5ThreadHasher() {
+    static thread_local MD5Hasher hasher;
+    // 在两次调用之间跟上MD5UseBackend的修改；调用返回的MD5Hasher期间不会再改变
+    MD5Backend backend = MD5CurrentBackend();
+    if (hasher.Backend() != backend) {
+        hasher.UseBackend(backend);
+    }
+    return hasher;
+}
+
+// 十六进制字符的值，不是十六进制字符时为-1
+static inline int HexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+// 解析[p, end)开头的32个十六进制字符，其后必须是行尾或者不是十六进制字符，结果格式与MD5Hash的state相同
+static bool ParseHexDigest(const char *p, const char *end, MD5Digest &digest) {
+    if (end - p < 32 || (end - p > 32 && HexValue(p[32]) >= 0)) {
+        return false;
+    }
+    for (int i = 0; i < 4; i++) {
+        bit32 w = 0;
+        for (int k = 0; k < 8; k++) {
+            int v = HexValue(p[8 * i + k]);
+            if (v < 0) {
+                return false;
+            }
+            w = w << 4 | v;
+        }
+        digest.state[i] = w;
+    }
+    return true;
+}
+
+bool MD5TargetSet::load(const string &path, size_t *skipped) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    vector<MD5Digest> digests;
+    size_t rejected = 0;
+    if (size > 0) {
+        void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        madvise(addr, size, MADV_SEQUENTIAL);
+        // 每行33字节左右，先按文件大小预留空间
+        digests.reserve(size / 33 + 1);
+        const char *p = (const char *)addr, *end = p + size;
+        while (p < end) {
+            const char *line_end = (const char *)memchr(p, '\n', end - p);
+            if (line_end == nullptr) {
+                line_end = end;
+            }
+            while (p < line_end && (*p == ' ' || *p == '\t')) {
+                p++;
+            }
+            MD5Digest digest;
+            if (ParseHexDigest(p, line_end, digest)) {
+                digests.push_back(digest);
+            } else if (p < line_end && !(p + 1 == line_end && *p == '\r')) {
+                // 空行不算无法解析
+                rejected++;
+            }
+            p = line_end + 1;
+        }
+        munmap(addr, size);
+    }
+    close(fd);
+    if (skipped != nullptr) {
+        *skipped = rejected;
+    }
+    // 有内容却没有一行是MD5（例如口令列表或者"hash:salt"格式），多半是给错了文件
+    if (digests.empty() && rejected > 0) {
+        return false;
+    }
+    assign(digests.data(), digests.size());
+    return true;
+}
+
+void MD5TargetSet::assign(const MD5Digest *digests, size_t n) {
+    vector<pair<uint64_t, uint64_t>> keys(n);
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = {Prefix(digests[i].state), Suffix(digests[i].state)};
+    }
+    sort(keys.begin(), keys.end());
+    keys.erase(unique(keys.begin(), keys.end()), keys.end());
+    prefixes.resize(keys.size());
+    suffixes.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        prefixes[i] = keys[i].first;
+        suffixes[i] = keys[i].second;
+    }
+    BuildIndex();
+}
+
+// 把v重新分配为n个0；较大的数组在写入之前先申请透明大页，随机查找时TLB缺失少得多
+template <typename T>
+static void AssignWithHugePages(vector<T> &v, size_t n) {
+    vector<T>().swap(v);
+    v.reserve(n);
+    const uintptr_t HUGE_PAGE = 2 << 20;
+    uintptr_t begin = ((uintptr_t)v.data() + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+    uintptr_t end = ((uintptr_t)v.data() + n * sizeof(T)) & ~(HUGE_PAGE - 1);
+    if (begin < end) {
+        madvise((void *)begin, end - begin, MADV_HUGEPAGE);
+    }
+    v.assign(n, 0);
+}
+
+void MD5TargetSet::BuildIndex() {
+    size_t n = prefixes.size();
+    // 位图至少2^16位，每个目标约16位，误判（不是目标却命中位图）的概率约为6%
+    int bitmap_bits = 16;
+    while (bitmap_bits < 36 && ((uint64_t)1 << bitmap_bits) < 16 * (uint64_t)n) {
+        bitmap_bits++;
+    }
+    bitmap_shift = 64 - bitmap_bits;
+    AssignWithHugePages(bitmap, ((uint64_t)1 << bitmap_bits) / 64);
+    for (uint64_t prefix : prefixes) {
+        uint64_t bit = prefix >> bitmap_shift;
+        bitmap[bit >> 6] |= (uint64_t)1 << (bit & 63);
+    }
+
+    // 目录的项数与目标个数相当，每一段平均只有一个目标
+    int directory_bits = 1;
+    while (directory_bits < 31 && ((uint64_t)1 << directory_bits) < n) {
+        directory_bits++;
+    }
+    directory_shift = 64 - directory_bits;
+    AssignWithHugePages(directory, ((size_t)1 << directory_bits) + 1);
+    for (uint64_t prefix : prefixes) {
+        directory[(prefix >> directory_shift) + 1] += 1;
+    }
+    for (size_t d = 1; d < directory.size(); d++) {
+        directory[d] += directory[d - 1];
+    }
+}
+
+void MD5TargetSet::serialize(string &buf) const {
+    buf.assign((const char *)prefixes.data(), prefixes.size() * sizeof(uint64_t));
+    buf.append((const char *)suffixes.data(), suffixes.size() * sizeof(uint64_t));
+}
+
+bool MD5TargetSet::deserialize(const char *data, size_t size) {
+    if (size % (2 * sizeof(uint64_t)) != 0) {
+        prefixes.clear();
+        suffixes.clear();
+        BuildIndex();
+        return false;
+    }
+    size_t n = size / (2 * sizeof(uint64_t));
+    prefixes.resize(n);
+    suffixes.resize(n);
+    memcpy(prefixes.data(), data, n * sizeof(uint64_t));
+    memcpy(suffixes.data(), data + n * sizeof(uint64_t), n * sizeof(uint64_t));
+    // 查找依赖于目标严格按(前缀, 后缀)递增排列，损坏的数据不能使用
+    for (size_t i = 1; i < n; i++) {
+        if (prefixes[i - 1] > prefixes[i] || (prefixes[i - 1] == prefixes[i] && suffixes[i - 1] >= suffixes[i])) {
+            prefixes.clear();
+            suffixes.clear();
+            BuildIndex();
+            return false;
+        }
+    }
+    BuildIndex();
+    return true;
+}
+
+void MD5TargetSet::find(const MD5Digest *digests, size_t n, vector<size_t> &hits) const {
+    const size_t CHUNK = 256;
+    uint32_t candidates[CHUNK];
+    for (size_t begin = 0; begin < n; begin += CHUNK) {
+        size_t end = min(n, begin + CHUNK);
+        // 第一遍：无分支地记录命中位图的结果
+        size_t m = 0;
+        for (size_t i = begin; i < end; i++) {
+            uint64_t bit = Prefix(digests[i].state) >> bitmap_shift;
+            candidates[m] = i - begin;
+            m += (bitmap[bit >> 6] >> (bit & 63)) & 1;
+        }
+        // 第二遍：先预取这些结果的目录项，再逐个比较
+        for (size_t k = 0; k < m; k++) {
+            size_t d = Prefix(digests[begin + candidates[k]].state) >> directory_shift;
+            __builtin_prefetch(&directory[d]);
+        }
+        for (size_t k = 0; k < m; k++) {
+            size_t i = begin + candidates[k];
+            if (contains(digests[i].state)) {
+                hits.push_back(i);
+            }
+        }
+    }
+}
+
+// MD5_ROUNDS中每一步的参数，用于从目标反向计算最后几步
+enum { MD5_REG_A, MD5_REG_B, MD5_REG_C, MD5_REG_D };
+struct MD5StepInfo
+{
+    char f;
+    int a, b, c, d, j, s;
+    bit32 ac;
+};
+#define STEP_INFO(f, a, b, c, d, j, s, ac) {#f[0], MD5_REG_##a, MD5_REG_##b, MD5_REG_##c, MD5_REG_##d, j, s, ac},
+static const MD5StepInfo md5_steps[64] = {MD5_ROUNDS(STEP_INFO)};
+
+static inline bit32 StepFunction(char f, bit32 x, bit32 y, bit32 z) {
+    switch (f) {
+    case 'F':
+        return F(x, y, z);
+    case 'G':
+        return G(x, y, z);
+    case 'H':
+        return H(x, y, z);
+    default:
+        return I(x, y, z);
+    }
+}
 
-void CleanupMD5Resources() {
-    delete[] reusable_buffers;
-    reusable_buffers = nullptr;
-    total_buffer_capacity = 0;
+// 第k步的逆：已知这一步之后的a和b、c、d（这一步不改变b、c、d），求这一步之前的a，不包括这一步使用的字
+static inline bit32 UndoStep(int k, const bit32 regs[4]) {
+    const MD5StepInfo &st = md5_steps[k - 1];
+    bit32 x = regs[st.a] - regs[st.b];
+    return ((x >> st.s) | (x << (32 - st.s))) - StepFunction(st.f, regs[st.b], regs[st.c], regs[st.d]) - st.ac;
+}
+
+void MD5SmallTargetSet::assign(const MD5Digest *targets, int n) {
+    const bit32 init[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    count = n;
+    for (int i = 0; i < n; i++) {
+        digests[i] = targets[i];
+        final_a[i] = __builtin_bswap32(targets[i].state[0]) - init[0];
+    }
+    // 对每个长度L，从目标开始撤销第64步到第OneBlockExitStep(L) + 1步（这些步使用的字都是常数）
+    // 再撤销第OneBlockExitStep(L)步中除了可变的字以外的部分
+    for (int L = 0; L <= MD5_ONE_BLOCK_MAX; L++) {
+        bit32 regs[4];
+        for (int r = 0; r < 4; r++) {
+            regs[r] = __builtin_bswap32(targets[0].state[r]) - init[r];
+        }
+        int k = 64;
+        for (; k > OneBlockExitStep(L); k--) {
+            regs[md5_steps[k - 1].a] = UndoStep(k, regs) - OneBlockConstWord(L, md5_steps[k - 1].j);
+        }
+        reverse[L] = UndoStep(k, regs);
+    }
 }
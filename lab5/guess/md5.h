@@ -1,7 +1,43 @@
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <cstdint>
+#include <vector>
+#if defined(__ARM_NEON) || defined(__aarch64__)
 #include <arm_neon.h>
+#elif defined(__SSE2__)
+// x86-64：用SSE2实现下面用到的NEON intrinsic，4路SIMD的代码（MD5Hash_SIMD等）不需要改动
+// AVX2和AVX-512的8路、16路版本在md5.cpp中单独实现，运行时根据CPUID选择
+#include <emmintrin.h>
+// 与NEON的uint32x4_t一样是4个无符号32位整数的向量类型，需要时再转换成__m128i
+typedef unsigned int uint32x4_t __attribute__((vector_size(16)));
+inline uint32x4_t vdupq_n_u32(unsigned int x) { return (uint32x4_t)_mm_set1_epi32((int)x); }
+inline uint32x4_t vld1q_u32(const unsigned int *p) { return (uint32x4_t)_mm_loadu_si128((const __m128i *)p); }
+inline void vst1q_u32(unsigned int *p, uint32x4_t a) { _mm_storeu_si128((__m128i *)p, (__m128i)a); }
+inline uint32x4_t vaddq_u32(uint32x4_t a, uint32x4_t b) { return (uint32x4_t)_mm_add_epi32((__m128i)a, (__m128i)b); }
+inline uint32x4_t vsubq_u32(uint32x4_t a, uint32x4_t b) { return (uint32x4_t)_mm_sub_epi32((__m128i)a, (__m128i)b); }
+inline uint32x4_t vandq_u32(uint32x4_t a, uint32x4_t b) { return (uint32x4_t)_mm_and_si128((__m128i)a, (__m128i)b); }
+inline uint32x4_t vorrq_u32(uint32x4_t a, uint32x4_t b) { return (uint32x4_t)_mm_or_si128((__m128i)a, (__m128i)b); }
+inline uint32x4_t veorq_u32(uint32x4_t a, uint32x4_t b) { return (uint32x4_t)_mm_xor_si128((__m128i)a, (__m128i)b); }
+inline uint32x4_t vmvnq_u32(uint32x4_t a) { return (uint32x4_t)_mm_xor_si128((__m128i)a, _mm_set1_epi32(-1)); }
+// mask中为1的位取a，否则取b
+inline uint32x4_t vbslq_u32(uint32x4_t mask, uint32x4_t a, uint32x4_t b)
+{
+    return (uint32x4_t)_mm_or_si128(_mm_and_si128((__m128i)mask, (__m128i)a), _mm_andnot_si128((__m128i)mask, (__m128i)b));
+}
+// SSE2只有有符号比较，先翻转符号位
+inline uint32x4_t vcgtq_u32(uint32x4_t a, uint32x4_t b)
+{
+    const __m128i sign = _mm_set1_epi32((int)0x80000000);
+    return (uint32x4_t)_mm_cmpgt_epi32(_mm_xor_si128((__m128i)a, sign), _mm_xor_si128((__m128i)b, sign));
+}
+inline uint32x4_t vceqq_u32(uint32x4_t a, uint32x4_t b) { return (uint32x4_t)_mm_cmpeq_epi32((__m128i)a, (__m128i)b); }
+// 移位量必须是编译期常量
+#define vshlq_n_u32(a, n) ((uint32x4_t)_mm_slli_epi32((__m128i)(a), (n)))
+#define vshrq_n_u32(a, n) ((uint32x4_t)_mm_srli_epi32((__m128i)(a), (n)))
+#else
+#error "md5.h需要ARM NEON或x86 SSE2"
+#endif
 
 using namespace std;
 
@@ -120,13 +156,286 @@ typedef uint32x4_t bit32x4_t;  // 4个32位整数的向量
   (a) = vaddq_u32((a), (b)); \
 }
 
-void MD5Hash(string input, bit32 *state);
+// MD5全部64步的列表：对每一步调用STEP(f, a, b, c, d, j, s, ac)，f为F/G/H/I，j为这一步使用的字的下标
+// 各个宽度的SIMD实现（例如md5.cpp中的AVX2、AVX-512版本）只需要定义自己的STEP
+#define MD5_ROUNDS(STEP) \
+  STEP(F, A, B, C, D, 0, s11, 0xd76aa478) STEP(F, D, A, B, C, 1, s12, 0xe8c7b756) \
+  STEP(F, C, D, A, B, 2, s13, 0x242070db) STEP(F, B, C, D, A, 3, s14, 0xc1bdceee) \
+  STEP(F, A, B, C, D, 4, s11, 0xf57c0faf) STEP(F, D, A, B, C, 5, s12, 0x4787c62a) \
+  STEP(F, C, D, A, B, 6, s13, 0xa8304613) STEP(F, B, C, D, A, 7, s14, 0xfd469501) \
+  STEP(F, A, B, C, D, 8, s11, 0x698098d8) STEP(F, D, A, B, C, 9, s12, 0x8b44f7af) \
+  STEP(F, C, D, A, B, 10, s13, 0xffff5bb1) STEP(F, B, C, D, A, 11, s14, 0x895cd7be) \
+  STEP(F, A, B, C, D, 12, s11, 0x6b901122) STEP(F, D, A, B, C, 13, s12, 0xfd987193) \
+  STEP(F, C, D, A, B, 14, s13, 0xa679438e) STEP(F, B, C, D, A, 15, s14, 0x49b40821) \
+  STEP(G, A, B, C, D, 1, s21, 0xf61e2562) STEP(G, D, A, B, C, 6, s22, 0xc040b340) \
+  STEP(G, C, D, A, B, 11, s23, 0x265e5a51) STEP(G, B, C, D, A, 0, s24, 0xe9b6c7aa) \
+  STEP(G, A, B, C, D, 5, s21, 0xd62f105d) STEP(G, D, A, B, C, 10, s22, 0x02441453) \
+  STEP(G, C, D, A, B, 15, s23, 0xd8a1e681) STEP(G, B, C, D, A, 4, s24, 0xe7d3fbc8) \
+  STEP(G, A, B, C, D, 9, s21, 0x21e1cde6) STEP(G, D, A, B, C, 14, s22, 0xc33707d6) \
+  STEP(G, C, D, A, B, 3, s23, 0xf4d50d87) STEP(G, B, C, D, A, 8, s24, 0x455a14ed) \
+  STEP(G, A, B, C, D, 13, s21, 0xa9e3e905) STEP(G, D, A, B, C, 2, s22, 0xfcefa3f8) \
+  STEP(G, C, D, A, B, 7, s23, 0x676f02d9) STEP(G, B, C, D, A, 12, s24, 0x8d2a4c8a) \
+  STEP(H, A, B, C, D, 5, s31, 0xfffa3942) STEP(H, D, A, B, C, 8, s32, 0x8771f681) \
+  STEP(H, C, D, A, B, 11, s33, 0x6d9d6122) STEP(H, B, C, D, A, 14, s34, 0xfde5380c) \
+  STEP(H, A, B, C, D, 1, s31, 0xa4beea44) STEP(H, D, A, B, C, 4, s32, 0x4bdecfa9) \
+  STEP(H, C, D, A, B, 7, s33, 0xf6bb4b60) STEP(H, B, C, D, A, 10, s34, 0xbebfbc70) \
+  STEP(H, A, B, C, D, 13, s31, 0x289b7ec6) STEP(H, D, A, B, C, 0, s32, 0xeaa127fa) \
+  STEP(H, C, D, A, B, 3, s33, 0xd4ef3085) STEP(H, B, C, D, A, 6, s34, 0x04881d05) \
+  STEP(H, A, B, C, D, 9, s31, 0xd9d4d039) STEP(H, D, A, B, C, 12, s32, 0xe6db99e5) \
+  STEP(H, C, D, A, B, 15, s33, 0x1fa27cf8) STEP(H, B, C, D, A, 2, s34, 0xc4ac5665) \
+  STEP(I, A, B, C, D, 0, s41, 0xf4292244) STEP(I, D, A, B, C, 7, s42, 0x432aff97) \
+  STEP(I, C, D, A, B, 14, s43, 0xab9423a7) STEP(I, B, C, D, A, 5, s44, 0xfc93a039) \
+  STEP(I, A, B, C, D, 12, s41, 0x655b59c3) STEP(I, D, A, B, C, 3, s42, 0x8f0ccc92) \
+  STEP(I, C, D, A, B, 10, s43, 0xffeff47d) STEP(I, B, C, D, A, 1, s44, 0x85845dd1) \
+  STEP(I, A, B, C, D, 8, s41, 0x6fa87e4f) STEP(I, D, A, B, C, 15, s42, 0xfe2ce6e0) \
+  STEP(I, C, D, A, B, 6, s43, 0xa3014314) STEP(I, B, C, D, A, 13, s44, 0x4e0811a1) \
+  STEP(I, A, B, C, D, 4, s41, 0xf7537e82) STEP(I, D, A, B, C, 11, s42, 0xbd3af235) \
+  STEP(I, C, D, A, B, 2, s43, 0x2ad7d2bb) STEP(I, B, C, D, A, 9, s44, 0xeb86d391)
+
+void MD5Hash(const string &input, bit32 *state);
+// 同上，输入为(指针, 长度)，不分配内存
+void MD5Hash(const char *input, size_t length, bit32 *state);
+// 流式计算MD5：MD5Init之后可以多次调用MD5Update追加数据，最后由MD5Final得到与MD5Hash格式相同的结果，全程不分配内存
+struct MD5Context
+{
+    bit32 state[4];
+    uint64_t length; // 已经输入的字节数
+    Byte buffer[64]; // 还没有凑满一个块的数据，共length % 64字节
+};
+void MD5Init(MD5Context &ctx);
+void MD5Update(MD5Context &ctx, const char *input, size_t length);
+void MD5Final(MD5Context &ctx, bit32 *state);
 void MD5Hash_SIMD(const string inputs[4], bit32 states[4][4]);
+// 同上，输入为4个(指针, 长度)，可以直接读取GuessBuffer等紧凑缓冲区中的猜测，不需要构造string
+// 4个输入的长度可以不同，块数较少的通道在处理完自己的块之后保持状态不变
+void MD5Hash_SIMD(const char *const inputs[4], const size_t lengths[4], bit32 states[4][4]);
+// 一组末尾不足4个（1 <= count <= 4）的输入，仍然以4路SIMD计算，结果写入states的前count项
+void MD5Hash_SIMD(const char *const inputs[], const size_t lengths[], int count, bit32 states[][4]);
+// 用K组4通道状态交错执行，一次哈希4 * K个输入（长度可以不同），K为1 ~ 4
+template <int K>
+void MD5Hash_SIMD_Interleaved(const char *const inputs[], const size_t lengths[], bit32 states[][4]);
+// 即MD5Hash_SIMD_Interleaved<2>
 void MD5Hash_SIMD8(const string inputs[8], bit32 states[8][4]);
 
-static Byte zero_buffer[MAX_BUFFER_SIZE] = {0};
-static const size_t BLOCK_OFFSETS[16] = {0, 4, 8, 12, 16, 20, 24, 28, 32, 36, 40, 44, 48, 52, 56, 60};
-static bit32x4_t M_static[16] __attribute__((aligned(16)));
-static Byte* reusable_buffers = nullptr;
-static size_t total_buffer_capacity = 0;
-void CleanupMD5Resources();
+// NEON/SSE2后端每次交给MD5Hash_SIMD_Interleaved的组数，可以在编译时用-DMD5_INTERLEAVE=1/2/3/4比较各种交错程度
+#ifndef MD5_INTERLEAVE
+#define MD5_INTERLEAVE 2
+#endif
+// 可用的SIMD后端：ARM上只有NEON；x86-64上在运行时根据CPUID选择SSE2（4路）、AVX2（8路）或AVX-512（16路）
+// 标量的MD5Hash始终作为验证各后端正确性的参照
+enum MD5Backend
+{
+    MD5_BACKEND_NEON,
+    MD5_BACKEND_SSE2,
+    MD5_BACKEND_AVX2,
+    MD5_BACKEND_AVX512
+};
+const char *MD5BackendName(MD5Backend backend);
+// 当前CPU是否支持这个后端
+bool MD5BackendSupported(MD5Backend backend);
+// 当前使用的后端，第一次调用时选择CPU支持的最宽的后端
+MD5Backend MD5CurrentBackend();
+// 改用指定的后端（例如在correctness中逐个验证），CPU不支持时返回false且不做改动
+// 应该在启动哈希线程之前调用：其他线程同时读取不会出错，但已经开始的调用仍然使用原来的后端
+bool MD5UseBackend(MD5Backend backend);
+// 当前后端一次哈希的输入个数：NEON/SSE2为4 * MD5_INTERLEAVE，AVX2为8，AVX-512为16
+int MD5BackendWidth();
+// 用当前后端哈希MD5BackendWidth()个输入，长度可以不同（长度都相同且只有一个块时自动改用下面的单块版本）；结果格式与MD5Hash_SIMD相同
+void MD5Hash_Wide(const char *const inputs[], const size_t lengths[], bit32 states[][4]);
+
+// 填充之后只有一个块的最大消息长度（字节）
+#define MD5_ONE_BLOCK_MAX 55
+// 同MD5Hash_Wide，但是所有输入的长度都是length（length <= MD5_ONE_BLOCK_MAX）
+// 使用按长度特化的单块版本：填充字节、全零的字和长度字都是编译期常量
+void MD5Hash_WideOneBlock(int length, const char *const inputs[], bit32 states[][4]);
+
+// 一个输入的MD5结果，格式与MD5Hash的state相同
+struct MD5Digest
+{
+    bit32 state[4];
+};
+// 批量哈希n个输入（n任意），第i个输入为ptrs[i]开始的lens[i]个字节，结果写入out[i]，与输入顺序一致
+// 调用者只需要给出每个猜测的位置和长度（例如GuessBuffer中的猜测），不需要构造string或凑齐4个一组，所有批量哈希都应使用这个接口
+// 先分桶（一个块的输入按确切长度，更长的按块数），同一个桶中的输入MD5BackendWidth()个一组进入MD5Hash_WideOneBlock或MD5Hash_Wide，
+// 各通道的长度或块数相同；每个桶最后不足一组的输入合在一起，4个一组处理
+// 各通道的消息按行向量读取，再在寄存器中转置成每个字一个向量，不再对每个字做逐通道的标量读取
+void MD5Hash_Batch(const uint8_t *const *ptrs, const uint32_t *lens, size_t n, MD5Digest *out);
+
+// 通道交错布局的4路MD5：words[b * 16 + j]的第l个分量，是第l个输入（已经完成填充）第b个块的第j个字
+// 即第l个输入的第k个字节位于 (Byte *)words + (k / 64) * 256 + (k % 64) / 4 * 16 + l * 4 + k % 4
+// 调用者可以把猜测直接写入这个布局并就地哈希，4个输入的块数必须都是n_blocks；结果格式与MD5Hash_SIMD相同
+void MD5Hash_SIMD_Blocks(const bit32x4_t *words, int n_blocks, bit32 states[4][4]);
+
+// 一组前缀相同的输入（例如同一个PT的所有猜测）共享的MD5中间状态，由MD5PrefixPrecompute计算
+// 前full_blocks个块完全位于前缀中，处理完这些块之后的状态为chain
+// 下一个块的前steps个字也完全位于前缀中，第1轮的前steps步只依赖于这些字，完成这些步之后的a, b, c, d为abcd
+struct MD5PrefixState
+{
+    int full_blocks;
+    int steps;
+    bit32 chain[4];
+    bit32 abcd[4];
+};
+void MD5PrefixPrecompute(const char *prefix, size_t prefix_len, MD5PrefixState &st);
+// 同上，但是4个输入都以st对应的前缀开头，从st中已经完成的部分继续计算
+// 前full_blocks个块不会被读取；第full_blocks个块中的前缀仍然需要写入布局，第2~4轮还会用到第1轮跳过的那些字
+void MD5Hash_SIMD_Blocks(const bit32x4_t *words, int n_blocks, bit32 states[4][4], const MD5PrefixState &st);
+
+// 上述布局中第l个输入的第k个字节的偏移
+inline size_t LaneByteOffset(int lane, size_t k)
+{
+    return (k / 64) * 256 + (k % 64) / 4 * 16 + lane * 4 + k % 4;
+}
+
+class MD5SmallTargetSet;
+
+// SIMD哈希时使用的暂存空间（填充后的消息、分桶用的数组），在多次调用之间复用，析构时释放
+// 各成员函数与上面同名的函数相同；每个线程使用自己的MD5Hasher，不同线程就可以同时哈希
+// 上面的函数使用的是当前线程自己的MD5Hasher（MD5ThreadHasher），同样可以在多个线程中同时调用
+// 每个MD5Hasher记录自己使用的后端（创建时为MD5CurrentBackend()），一次调用中的分组大小和各组使用的后端总是一致的
+class MD5Hasher
+{
+public:
+    MD5Hasher();
+    ~MD5Hasher();
+    MD5Hasher(const MD5Hasher &) = delete;
+    MD5Hasher &operator=(const MD5Hasher &) = delete;
+
+    void HashSIMD(const char *const inputs[4], const size_t lengths[4], bit32 states[4][4]);
+    void HashSIMD(const char *const inputs[], const size_t lengths[], int count, bit32 states[][4]);
+    template <int K>
+    void HashInterleaved(const char *const inputs[], const size_t lengths[], bit32 states[][4]);
+    void HashWide(const char *const inputs[], const size_t lengths[], bit32 states[][4]);
+    // match不为空时，单块版本在寄存器中与这些目标比较，确定所有通道都不是目标时提前结束并返回false，此时不写入states
+    bool HashOneBlock(int length, const char *const inputs[], bit32 states[][4], const MD5SmallTargetSet *match = nullptr);
+    void HashBatch(const uint8_t *const *ptrs, const uint32_t *lens, size_t n, MD5Digest *out);
+    void MatchBatch(const uint8_t *const *ptrs, const uint32_t *lens, size_t n, const MD5SmallTargetSet &targets, vector<size_t> &hits);
+
+    // 至少size字节、64字节对齐的暂存缓冲区，内容不会保留到下一次调用
+    Byte *Scratch(size_t size);
+
+    // 这个MD5Hasher使用的后端及其一次哈希的输入个数（HashWide/HashOneBlock的输入个数）
+    MD5Backend Backend() const
+    {
+        return backend;
+    }
+    int Width() const
+    {
+        return backend_width;
+    }
+    // 改用指定的后端，CPU不支持时返回false且不做改动；不能在这个MD5Hasher的调用进行中修改
+    bool UseBackend(MD5Backend new_backend);
+
+private:
+    // HashBatch和MatchBatch共同的分桶过程：match为空时结果写入out，否则只把属于match的输入的下标追加到hits中
+    void HashBuckets(const uint8_t *const *ptrs, const uint32_t *lens, size_t n, MD5Digest *out,
+                     const MD5SmallTargetSet *match, vector<size_t> *hits);
+
+    MD5Backend backend;
+    int backend_width;
+    Byte *scratch = nullptr;
+    size_t scratch_capacity = 0;
+    // HashBatch中计数排序使用的数组
+    vector<size_t> bucket_start;
+    vector<size_t> order;
+    vector<size_t> leftovers;
+};
+// 当前线程的MD5Hasher，线程结束时自动释放；每次返回之前都会改用MD5CurrentBackend()
+MD5Hasher &MD5ThreadHasher();
+
+// 需要破解的一组目标MD5（例如从哈希列表文件中读取），用来判断哈希得到的结果是否是其中之一
+// 目标按结果的前64位（state[0], state[1]）排序，后64位存放在对应的位置，每个目标共16字节
+// 查找分两层：位图按前缀的高位记录出现过的值（每个目标约16位），绝大多数不是目标的结果只访问位图的一个字就被排除；
+// 位图命中时，再由按更少的高位划分的目录找到排序数组中平均只有一个元素的一段，在其中比较完整的128位
+class MD5TargetSet
+{
+public:
+    // mmap读取十六进制的MD5列表，每行一个：行首（可以有空白）为32个十六进制字符，大小写均可
+    // 之后可以跟着其他内容（例如"hash:口令"），无法解析的行被跳过，skipped不为空时记录跳过的（非空）行数
+    // 无法打开文件，或者文件中有内容却没有任何一行可以解析时返回false
+    bool load(const string &path, size_t *skipped = nullptr);
+    // 直接由一组结果建立索引，重复的目标只保留一个
+    void assign(const MD5Digest *digests, size_t n);
+    // 排序后的目标（两个64位数组），用于在MPI进程之间广播；deserialize在长度不对或者没有按顺序排列时返回false，此时集合为空
+    void serialize(string &buf) const;
+    bool deserialize(const char *data, size_t size);
+
+    size_t size() const { return prefixes.size(); }
+    bool empty() const { return prefixes.empty(); }
+    // 排序后的第i个目标
+    MD5Digest at(size_t i) const
+    {
+        return MD5Digest{{bit32(prefixes[i] >> 32), bit32(prefixes[i]), bit32(suffixes[i] >> 32), bit32(suffixes[i])}};
+    }
+
+    // state与MD5Hash的输出格式相同
+    bool contains(const bit32 state[4]) const
+    {
+        uint64_t prefix = Prefix(state);
+        uint64_t bit = prefix >> bitmap_shift;
+        if (!((bitmap[bit >> 6] >> (bit & 63)) & 1))
+        {
+            return false;
+        }
+        uint64_t suffix = Suffix(state);
+        size_t d = prefix >> directory_shift;
+        for (uint32_t i = directory[d]; i < directory[d + 1] && prefixes[i] <= prefix; i += 1)
+        {
+            if (prefixes[i] == prefix && suffixes[i] == suffix)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    // 检查n个结果，把属于目标集合的结果的下标按顺序追加到hits中
+    // 每256个结果分两遍：先只查位图，各次访存互不依赖，位图远大于缓存时也能同时进行；再只对命中位图的少数结果查目录和排序数组
+    void find(const MD5Digest *digests, size_t n, vector<size_t> &hits) const;
+
+    static uint64_t Prefix(const bit32 state[4]) { return (uint64_t)state[0] << 32 | state[1]; }
+    static uint64_t Suffix(const bit32 state[4]) { return (uint64_t)state[2] << 32 | state[3]; }
+
+private:
+    void BuildIndex();
+
+    vector<uint64_t> prefixes;
+    vector<uint64_t> suffixes;
+    // 位图共2^(64 - bitmap_shift)位，目录共2^(64 - directory_shift) + 1项，directory[d]为前缀高位等于d的第一个目标
+    vector<uint64_t> bitmap{0};
+    int bitmap_shift = 63;
+    vector<uint32_t> directory{0, 0, 0};
+    int directory_shift = 63;
+};
+
+// 最多MD5_SMALL_TARGETS_MAX个目标时，不需要MD5TargetSet那样的索引：单块版本在最后几步时直接在寄存器中与目标比较
+#define MD5_SMALL_TARGETS_MAX 16
+class MD5SmallTargetSet
+{
+public:
+    // 1 <= n <= MD5_SMALL_TARGETS_MAX
+    void assign(const MD5Digest *digests, int n);
+    int size() const { return count; }
+    bool contains(const bit32 state[4]) const
+    {
+        for (int i = 0; i < count; i += 1)
+        {
+            if (memcmp(state, digests[i].state, sizeof(digests[i].state)) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // 以下为assign预先算好、供单块版本比较的值
+    int count = 0;
+    MD5Digest digests[MD5_SMALL_TARGETS_MAX];
+    // 多个目标：A寄存器在第61步之后不再改变，各目标对应的第61步之后的A（未加初始值），广播到向量寄存器中与各通道比较
+    bit32 final_a[MD5_SMALL_TARGETS_MAX];
+    // 单个目标：从目标开始反向计算最后几步，直到遇到使用消息中可变的字的一步（第e步，e只取决于消息长度L）
+    // 第e步更新的寄存器在第e - 4步之后应为reverse[L]减去第e步使用的字，在第e - 4步就可以排除几乎所有通道
+    bit32 reverse[MD5_ONE_BLOCK_MAX + 1];
+};
+// 在n个输入中找出MD5属于targets的输入，下标按输入顺序追加到hits中
+// 与MD5Hash_Batch的分桶方式相同；单块的输入在寄存器中与目标比较并提前结束，其余输入算出结果之后再比较
+void MD5Match_Batch(const uint8_t *const *ptrs, const uint32_t *lens, size_t n, const MD5SmallTargetSet &targets, vector<size_t> &hits);
@@ -2,6 +2,13 @@
 #include <fstream>
 #include <cctype>
 #include <algorithm>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 // 这个文件里面的各函数你都不需要完全理解，甚至根本不需要看
 // 从学术价值上讲，加速模型的训练过程是一个没什么价值的问题，因为我们一般假定统计学模型的训练成本较低
@@ -32,7 +39,7 @@ void model::train(string path)
         if (lines % 10000 == 0)
         {
             cout <<"Lines processed: "<< lines << endl;
-            // 在这里更改读取的训练集口令上限
+            // 在这里更改读取的训练集口令上限，多线程版本的MAX_TRAIN_PASSWORDS需要同步修改
             if (lines > 3000000)
             {
                 break;
@@ -43,48 +50,235 @@ void model::train(string path)
     }
 }
 
-/// @brief 在模型中找到一个PT的统计数据
-/// @param pt 需要查找的PT
-/// @return 目标PT在模型中的对应下标
-int model::FindPT(PT pt)
+// 与 >> 读取口令时使用的分隔符一致
+static bool IsPasswordSpace(char ch)
 {
-    for (int id = 0; id < preterminals.size(); id += 1)
+    return isspace((unsigned char)ch);
+}
+
+// 串行版本读到第3010000个口令时停止，并且这一个口令不parse，因此最多parse前3009999个口令
+static const long long MAX_TRAIN_PASSWORDS = 3010000 - 1;
+
+// 多线程训练的wrapper：将训练集mmap之后按字节均分为n_threads个连续的分片，每个线程只读取、parse自己的分片
+// 起始位置落在分片范围内的口令属于这个分片（口令本身可以跨过分片的末尾），因此每个口令恰好被一个分片读取
+// 第一遍各线程并行统计自己分片中的口令数目，据此计算口令上限落在哪个分片；第二遍并行parse
+// 读取的口令与串行版本完全相同（包括口令上限的判定方式），因此按分片顺序合并的结果与串行训练一致
+void model::train(string path, int n_threads)
+{
+    cout<<"Training..."<<endl;
+    cout<<"Training phase 1: reading and parsing passwords with "<<n_threads<<" threads..."<<endl;
+    if (n_threads < 1)
     {
-        if (preterminals[id].content.size() != pt.content.size())
+        n_threads = 1;
+    }
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        cout << "Cannot open training set " << path << endl;
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return;
+    }
+    size_t size = st.st_size;
+    void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        cout << "Cannot map training set " << path << endl;
+        return;
+    }
+    const char *data = (const char *)addr;
+
+    vector<size_t> bounds(n_threads + 1);
+    for (int t = 0; t <= n_threads; t += 1)
+    {
+        bounds[t] = size * t / n_threads;
+    }
+
+    // 第一遍：统计每个分片中的口令数目
+    vector<long long> counts(n_threads, 0);
+    #pragma omp parallel for num_threads(n_threads) schedule(static, 1)
+    for (int t = 0; t < n_threads; t += 1)
+    {
+        long long count = 0;
+        bool prev_space = bounds[t] == 0 || IsPasswordSpace(data[bounds[t] - 1]);
+        for (size_t i = bounds[t]; i < bounds[t + 1]; i += 1)
         {
-            continue;
+            bool space = IsPasswordSpace(data[i]);
+            count += prev_space && !space;
+            prev_space = space;
         }
-        else
+        counts[t] = count;
+    }
+    // 每个分片需要parse的口令数目：排在它前面的分片已经用掉的口令上限不能再用
+    vector<long long> quotas(n_threads);
+    long long before = 0;
+    for (int t = 0; t < n_threads; t += 1)
+    {
+        quotas[t] = max(0LL, min(counts[t], MAX_TRAIN_PASSWORDS - before));
+        before += counts[t];
+    }
+
+    // 第二遍：每个线程一个私有模型，线程之间没有任何共享写入
+    // 分片必须是连续的，这样按分片顺序合并才能复现串行训练时的“首次出现”顺序
+    vector<model> shards(n_threads);
+    #pragma omp parallel for num_threads(n_threads) schedule(static, 1)
+    for (int t = 0; t < n_threads; t += 1)
+    {
+        string pw;
+        long long parsed = 0;
+        size_t i = bounds[t];
+        while (parsed < quotas[t])
+        {
+            // 找到下一个口令的起点，第一遍已经保证它在分片范围之内
+            while (IsPasswordSpace(data[i]) || (i > 0 && !IsPasswordSpace(data[i - 1])))
+            {
+                i += 1;
+            }
+            size_t begin = i;
+            while (i < size && !IsPasswordSpace(data[i]))
+            {
+                i += 1;
+            }
+            pw.assign(data + begin, i - begin);
+            shards[t].parse(pw);
+            parsed += 1;
+        }
+    }
+    munmap(addr, size);
+
+    long long lines = 0;
+    for (int t = 0; t < n_threads; t += 1)
+    {
+        lines += quotas[t];
+    }
+    cout<<"Lines processed: "<< lines << endl;
+    cout<<"Training phase 1: merging "<<n_threads<<" shards..."<<endl;
+    for (int t = 0; t < n_threads; t += 1)
+    {
+        merge(shards[t]);
+    }
+}
+
+// 将src中的segment统计数据累加到dst中
+// 新出现的segment追加到dst末尾；新出现的value按照其在src中的id顺序插入，从而保证id与串行训练一致
+static void MergeSegments(model &dst, int type, const vector<segment> &src, const unordered_map<int, int> &src_freq)
+{
+    for (size_t src_id = 0; src_id < src.size(); src_id += 1)
+    {
+        const segment &s = src[src_id];
+        int id = dst.FindOrAddSegment(type, s.length);
+        dst.type_freq(type)[id] += src_freq.at(src_id);
+
+        // 按照src中value的id顺序遍历，而不是按照unordered_map的遍历顺序
+        vector<const string *> by_id(s.values.size());
+        for (const auto &value : s.values)
+        {
+            by_id[value.second] = &value.first;
+        }
+        segment &d = dst.type_segments(type)[id];
+        for (size_t vid = 0; vid < by_id.size(); vid += 1)
         {
-            bool equal_flag = true;
-            for (int idx = 0; idx < preterminals[id].content.size(); idx += 1)
+            int freq = s.freqs.at(vid);
+            auto iter = d.values.find(*by_id[vid]);
+            if (iter == d.values.end())
             {
-                if (preterminals[id].content[idx].type != pt.content[idx].type || preterminals[id].content[idx].length != pt.content[idx].length)
-                {
-                    equal_flag = false;
-                    break;
-                }
+                int new_id = d.values.size();
+                d.values.emplace(*by_id[vid], new_id);
+                d.freqs[new_id] = freq;
             }
-            if (equal_flag == true)
+            else
             {
-                return id;
+                d.freqs[iter->second] += freq;
             }
         }
     }
+}
+
+void model::merge(const model &other)
+{
+    total_preterm += other.total_preterm;
+    for (size_t src_id = 0; src_id < other.preterminals.size(); src_id += 1)
+    {
+        const PT &pt = other.preterminals[src_id];
+        int id = FindPT(pt);
+        if (id == -1)
+        {
+            id = AddPT(pt);
+        }
+        preterm_freq[id] += other.preterm_freq.at(src_id);
+    }
+    MergeSegments(*this, 1, other.letters, other.letters_freq);
+    MergeSegments(*this, 2, other.digits, other.digits_freq);
+    MergeSegments(*this, 3, other.symbols, other.symbols_freq);
+}
+
+// PT的签名：依次混入每个segment的type和length，相同结构的PT签名相同
+// 签名只是一个整数，不同结构的PT可能签名相同，因此查找时还需要用SameStructure逐个确认
+size_t model::PTSignature(const PT &pt)
+{
+    uint64_t sig = pt.content.size();
+    for (const segment &seg : pt.content)
+    {
+        sig = (sig ^ ((uint64_t)seg.type << 32 | (uint32_t)seg.length)) * 0x9E3779B97F4A7C15ULL;
+        sig ^= sig >> 29;
+    }
+    return sig;
+}
+
+// 两个PT的各segment的type和length是否完全相同
+static bool SameStructure(const PT &a, const PT &b)
+{
+    if (a.content.size() != b.content.size())
+    {
+        return false;
+    }
+    for (size_t i = 0; i < a.content.size(); i += 1)
+    {
+        if (a.content[i].type != b.content[i].type || a.content[i].length != b.content[i].length)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// @brief 在模型中找到一个PT的统计数据
+/// @param pt 需要查找的PT
+/// @return 目标PT在模型中的对应下标
+int model::FindPT(const PT &pt) const
+{
+    auto range = pt_ids.equal_range(PTSignature(pt));
+    for (auto iter = range.first; iter != range.second; ++iter)
+    {
+        if (SameStructure(preterminals[iter->second], pt))
+        {
+            return iter->second;
+        }
+    }
     return -1;
 }
 
+int model::AddPT(const PT &pt)
+{
+    int id = GetNextPretermID();
+    preterminals.emplace_back(pt);
+    pt_ids.emplace(PTSignature(pt), id);
+    return id;
+}
+
 /// @brief 在模型中找到一个letter segment的统计数据
 /// @param seg 要找的letter segment
 /// @return 目标letter segment的对应下标
-int model::FindLetter(segment seg)
+int model::FindLetter(const segment &seg) const
 {
-    for (int id = 0; id < letters.size(); id += 1)
+    if ((size_t)seg.length < segment_ids[1].size())
     {
-        if (letters[id].length == seg.length)
-        {
-            return id;
-        }
+        return segment_ids[1][seg.length];
     }
     return -1;
 }
@@ -92,45 +286,56 @@ int model::FindLetter(segment seg)
 /// @brief 在模型中找到一个digit segment的统计数据
 /// @param seg 要找的digit segment
 /// @return 目标digit segment的对应下标
-int model::FindDigit(segment seg)
+int model::FindDigit(const segment &seg) const
 {
-    for (int id = 0; id < digits.size(); id += 1)
+    if ((size_t)seg.length < segment_ids[2].size())
     {
-        if (digits[id].length == seg.length)
-        {
-            return id;
-        }
+        return segment_ids[2][seg.length];
     }
     return -1;
 }
 
-int model::FindSymbol(segment seg)
+int model::FindSymbol(const segment &seg) const
 {
-    for (int id = 0; id < symbols.size(); id += 1)
+    if ((size_t)seg.length < segment_ids[3].size())
     {
-        if (symbols[id].length == seg.length)
-        {
-            return id;
-        }
+        return segment_ids[3][seg.length];
     }
     return -1;
 }
 
-void PT::insert(segment seg)
+int model::FindOrAddSegment(int type, int length)
+{
+    vector<int> &ids = segment_ids[type];
+    if ((size_t)length >= ids.size())
+    {
+        ids.resize(length + 1, -1);
+    }
+    if (ids[length] == -1)
+    {
+        ids[length] = GetNextSegmentID(type);
+        type_segments(type).emplace_back(segment(type, length));
+    }
+    return ids[length];
+}
+
+void PT::insert(const segment &seg)
 {
     content.emplace_back(seg);
 }
 
-void segment::insert(string value)
+void segment::insert(const string &value)
 {
-    if (values.find(value) == values.end())
+    auto iter = values.find(value);
+    if (iter == values.end())
     {
-        values[value] = values.size();
-        freqs[values[value]] = 1;
+        int id = values.size();
+        values.emplace(value, id);
+        freqs[id] = 1;
     }
     else
     {
-        freqs[values[value]] += 1;
+        freqs[iter->second] += 1;
     }
 }
 
@@ -161,7 +366,15 @@ void segment::order()
     }
 }
 
-void model::parse(string pw)
+void model::InsertSegment(PT &pt, int type, const string &value)
+{
+    int id = FindOrAddSegment(type, value.length());
+    type_freq(type)[id] += 1;
+    type_segments(type)[id].insert(value);
+    pt.insert(segment(type, value.length()));
+}
+
+void model::parse(const string &pw)
 {
     PT pt;
     string curr_part = "";
@@ -170,226 +383,43 @@ void model::parse(string pw)
     // 相信我，以后你会用上的。You're welcome :)
     for (char ch : pw)
     {
+        int type;
         if (isalpha(ch))
         {
-            if (curr_type != 1)
-            {
-                if (curr_type == 2)
-                {
-                    segment seg(curr_type, curr_part.length());
-                    if (FindDigit(seg) == -1)
-                    {
-                        int id = GetNextDigitsID();
-                        digits.emplace_back(seg);
-                        digits[id].insert(curr_part);
-                        digits_freq[id] = 1;
-                    }
-                    else
-                    {
-                        int id = FindDigit(seg);
-                        digits_freq[id] += 1;
-                        digits[id].insert(curr_part);
-                    }
-                    curr_part.clear();
-                    pt.insert(seg);
-                }
-                else if (curr_type == 3)
-                {
-                    segment seg(curr_type, curr_part.length());
-                    if (FindSymbol(seg) == -1)
-                    {
-                        int id = GetNextSymbolsID();
-                        symbols.emplace_back(seg);
-                        symbols_freq[id] = 1;
-                        symbols[id].insert(curr_part);
-                    }
-                    else
-                    {
-                        int id = FindSymbol(seg);
-                        symbols_freq[id] += 1;
-                        symbols[id].insert(curr_part);
-                    }
-                    curr_part.clear();
-                    pt.insert(seg);
-                }
-            }
-            curr_type = 1;
-            curr_part += ch;
+            type = 1;
         }
         else if (isdigit(ch))
         {
-            if (curr_type != 2)
-            {
-                if (curr_type == 1)
-                {
-                    segment seg(curr_type, curr_part.length());
-                    if (FindLetter(seg) == -1)
-                    {
-                        int id = GetNextLettersID();
-                        letters.emplace_back(seg);
-                        letters_freq[id] = 1;
-                        letters[id].insert(curr_part);
-                    }
-                    else
-                    {
-                        int id = FindLetter(seg);
-                        letters_freq[id] += 1;
-                        letters[id].insert(curr_part);
-                    }
-                    curr_part.clear();
-                    pt.insert(seg);
-                }
-                else if (curr_type == 3)
-                {
-                    segment seg(curr_type, curr_part.length());
-                    if (FindSymbol(seg) == -1)
-                    {
-                        int id = GetNextSymbolsID();
-                        symbols.emplace_back(seg);
-                        symbols_freq[id] = 1;
-                        symbols[id].insert(curr_part);
-                    }
-                    else
-                    {
-                        int id = FindSymbol(seg);
-                        symbols_freq[id] += 1;
-                        symbols[id].insert(curr_part);
-                    }
-                    curr_part.clear();
-                    pt.insert(seg);
-                }
-            }
-            curr_type = 2;
-            curr_part += ch;
+            type = 2;
         }
         else
         {
-            if (curr_type != 3)
-            {
-                if (curr_type == 1)
-                {
-                    segment seg(curr_type, curr_part.length());
-                    if (FindLetter(seg) == -1)
-                    {
-                        int id = GetNextLettersID();
-                        letters.emplace_back(seg);
-                        letters_freq[id] = 1;
-                        letters[id].insert(curr_part);
-                    }
-                    else
-                    {
-                        int id = FindLetter(seg);
-                        letters_freq[id] += 1;
-                        letters[id].insert(curr_part);
-                    }
-                    curr_part.clear();
-                    pt.insert(seg);
-                }
-                else if (curr_type == 2)
-                {
-                    segment seg(curr_type, curr_part.length());
-                    if (FindDigit(seg) == -1)
-                    {
-                        int id = GetNextDigitsID();
-                        digits.emplace_back(seg);
-                        digits_freq[id] = 1;
-                        digits[id].insert(curr_part);
-                    }
-                    else
-                    {
-                        int id = FindDigit(seg);
-                        digits_freq[id] += 1;
-                        digits[id].insert(curr_part);
-                    }
-                    curr_part.clear();
-                    pt.insert(seg);
-                }
-            }
-            curr_type = 3;
-            curr_part += ch;
-        }
-    }
-    if (!curr_part.empty())
-    {
-        if (curr_type == 1)
-        {
-            segment seg(curr_type, curr_part.length());
-            if (FindLetter(seg) == -1)
-            {
-                int id = GetNextLettersID();
-                letters.emplace_back(seg);
-                letters_freq[id] = 1;
-                letters[id].insert(curr_part);
-            }
-            else
-            {
-                int id = FindLetter(seg);
-                letters_freq[id] += 1;
-                letters[id].insert(curr_part);
-            }
-            curr_part.clear();
-            pt.insert(seg);
+            type = 3;
         }
-        else if (curr_type == 2)
+        // 字符类型发生变化时，前面连续的一段字符构成一个segment
+        if (curr_type != type && curr_type != 0)
         {
-            segment seg(curr_type, curr_part.length());
-            if (FindDigit(seg) == -1)
-            {
-                int id = GetNextDigitsID();
-                digits.emplace_back(seg);
-                digits_freq[id] = 1;
-                digits[id].insert(curr_part);
-            }
-            else
-            {
-                int id = FindDigit(seg);
-                digits_freq[id] += 1;
-                digits[id].insert(curr_part);
-            }
+            InsertSegment(pt, curr_type, curr_part);
             curr_part.clear();
-            pt.insert(seg);
-        }
-        else
-        {
-            segment seg(curr_type, curr_part.length());
-            if (FindSymbol(seg) == -1)
-            {
-                int id = GetNextSymbolsID();
-                symbols.emplace_back(seg);
-                symbols_freq[id] = 1;
-                symbols[id].insert(curr_part);
-            }
-            else
-            {
-                int id = FindSymbol(seg);
-                symbols_freq[id] += 1;
-                symbols[id].insert(curr_part);
-            }
-            curr_part.clear();
-            pt.insert(seg);
         }
+        curr_type = type;
+        curr_part += ch;
+    }
+    if (!curr_part.empty())
+    {
+        InsertSegment(pt, curr_type, curr_part);
     }
-    // pt.PrintPT();
-    // cout<<endl;
-    // cout << FindPT(pt) << endl;
     total_preterm += 1;
-    if (FindPT(pt) == -1)
+    int id = FindPT(pt);
+    if (id == -1)
     {
         for (int i = 0; i < pt.content.size(); i += 1)
         {
             pt.curr_indices.emplace_back(0);
         }
-        int id = GetNextPretermID();
-        // cout << id << endl;
-        preterminals.emplace_back(pt);
-        preterm_freq[id] = 1;
-    }
-    else
-    {
-        int id = FindPT(pt);
-        // cout << id << endl;
-        preterm_freq[id] += 1;
+        id = AddPT(pt);
     }
+    preterm_freq[id] += 1;
 }
 
 void segment::PrintSeg()
@@ -473,10 +503,10 @@ bool compareByPretermProb(const PT& a, const PT& b) {
 void model::order()
 {
     cout << "Training phase 2: Ordering segment values and PTs..." << endl;
-    for (PT pt : preterminals)
+    for (size_t id = 0; id < preterminals.size(); id += 1)
     {
-        pt.preterm_prob = float(preterm_freq[FindPT(pt)]) / total_preterm;
-        ordered_pts.emplace_back(pt);
+        ordered_pts.emplace_back(preterminals[id]);
+        ordered_pts.back().preterm_prob = float(preterm_freq[id]) / total_preterm;
     }
     bool swapped;
     cout << "total pts" << ordered_pts.size() << endl;
@@ -500,4 +530,603 @@ void model::order()
     {
         symbols[i].order();
     }
-}
\ No newline at end of file
+    BuildFlat();
+}
+
+// 模型文件格式（所有整数均为本机字节序的int32，x86与ARM均为小端）：
+// magic "PCFGMDL\0" | version
+// preterm_id letters_id digits_id symbols_id total_preterm
+// PT数目 | 对每个PT：segment数目, (type, length)... , 频数
+// 对letters/digits/symbols：segment数目 | 对每个segment：length, 频数, total_freq, value数目, 各value(长度+内容), 频数数目, 各value的频数
+// ordered_pts数目 | 各ordered_pt在preterminals中的下标
+static const char MODEL_MAGIC[8] = {'P', 'C', 'F', 'G', 'M', 'D', 'L', '\0'};
+static const int MODEL_VERSION = 1;
+
+static void PutInt(string &buf, int value)
+{
+    buf.append((const char *)&value, sizeof(int));
+}
+
+static void PutSegments(string &buf, const model &m, const vector<segment> &segs, const unordered_map<int, int> &segs_freq)
+{
+    PutInt(buf, segs.size());
+    for (size_t id = 0; id < segs.size(); id += 1)
+    {
+        // 从扁平化数据中读取value和频数，这样通过load_mapped加载的模型也可以被序列化
+        const segment &seg = segs[id];
+        PutInt(buf, seg.length);
+        PutInt(buf, segs_freq.at(id));
+        PutInt(buf, seg.total_freq);
+        PutInt(buf, seg.value_count);
+        for (int i = 0; i < seg.value_count; i += 1)
+        {
+            PutInt(buf, seg.length);
+            buf.append(m.ValueAt(seg, i), seg.length);
+        }
+        PutInt(buf, seg.value_count);
+        for (int i = 0; i < seg.value_count; i += 1)
+        {
+            PutInt(buf, m.FreqAt(seg, i));
+        }
+    }
+}
+
+void model::serialize(string &buf) const
+{
+    buf.clear();
+    buf.append(MODEL_MAGIC, sizeof(MODEL_MAGIC));
+    PutInt(buf, MODEL_VERSION);
+    PutInt(buf, preterm_id);
+    PutInt(buf, letters_id);
+    PutInt(buf, digits_id);
+    PutInt(buf, symbols_id);
+    PutInt(buf, total_preterm);
+
+    PutInt(buf, preterminals.size());
+    for (size_t id = 0; id < preterminals.size(); id += 1)
+    {
+        const PT &pt = preterminals[id];
+        PutInt(buf, pt.content.size());
+        for (const segment &seg : pt.content)
+        {
+            PutInt(buf, seg.type);
+            PutInt(buf, seg.length);
+        }
+        PutInt(buf, preterm_freq.at(id));
+    }
+
+    PutSegments(buf, *this, letters, letters_freq);
+    PutSegments(buf, *this, digits, digits_freq);
+    PutSegments(buf, *this, symbols, symbols_freq);
+
+    PutInt(buf, ordered_pts.size());
+    for (const PT &pt : ordered_pts)
+    {
+        PutInt(buf, FindPT(pt));
+    }
+}
+
+// 反序列化时使用的读取游标，所有读取都会检查边界，避免损坏的文件导致越界
+struct ModelReader
+{
+    const char *curr;
+    const char *end;
+    bool ok = true;
+
+    int GetInt()
+    {
+        int value = 0;
+        if (end - curr < (long)sizeof(int))
+        {
+            ok = false;
+            return 0;
+        }
+        memcpy(&value, curr, sizeof(int));
+        curr += sizeof(int);
+        return value;
+    }
+
+    // 读取一个数目，负数或明显超出剩余数据量的数目视为格式错误
+    int GetCount()
+    {
+        int count = GetInt();
+        if (count < 0 || count > end - curr)
+        {
+            ok = false;
+            return 0;
+        }
+        return count;
+    }
+};
+
+// 每个PT中的segment都必须在segment表中存在，否则GetSegment/FindLetter等会越界
+static bool PTSegmentsExist(const model &m)
+{
+    for (const PT &pt : m.preterminals)
+    {
+        for (const segment &seg : pt.content)
+        {
+            const vector<int> &ids = m.segment_ids[seg.type];
+            if ((size_t)seg.length >= ids.size() || ids[seg.length] == -1)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool GetSegments(ModelReader &in, model &m, int type)
+{
+    int n_segs = in.GetCount();
+    for (int id = 0; id < n_segs && in.ok; id += 1)
+    {
+        // 每个segment至少有一个长度为length的value，过大的length说明文件已经损坏，不能用来扩展segment_ids
+        int length = in.GetInt();
+        if (length <= 0 || length > in.end - in.curr || m.FindOrAddSegment(type, length) != id)
+        {
+            return false;
+        }
+        m.type_freq(type)[id] = in.GetInt();
+        segment &seg = m.type_segments(type)[id];
+        seg.total_freq = in.GetInt();
+        int n_values = in.GetCount();
+        seg.ordered_values.reserve(n_values);
+        for (int i = 0; i < n_values && in.ok; i += 1)
+        {
+            // BuildFlat/ValueAt按 pool_offset + i * length 定位value，因此每个value的长度都必须等于segment的length
+            int len = in.GetCount();
+            if (!in.ok || len != length || in.end - in.curr < len)
+            {
+                return false;
+            }
+            seg.ordered_values.emplace_back(in.curr, len);
+            in.curr += len;
+        }
+        // 每个value都要有对应的频数
+        int n_freqs = in.GetCount();
+        size_t freqs_size = (size_t)n_freqs * sizeof(int);
+        if (!in.ok || n_freqs != n_values || (size_t)(in.end - in.curr) < freqs_size)
+        {
+            return false;
+        }
+        seg.ordered_freqs.resize(n_freqs);
+        memcpy(seg.ordered_freqs.data(), in.curr, freqs_size);
+        in.curr += freqs_size;
+    }
+    return in.ok;
+}
+
+bool model::deserialize(const char *data, size_t size)
+{
+    *this = model();
+    ModelReader in{data, data + size};
+    if (size < sizeof(MODEL_MAGIC) || memcmp(data, MODEL_MAGIC, sizeof(MODEL_MAGIC)) != 0)
+    {
+        return false;
+    }
+    in.curr += sizeof(MODEL_MAGIC);
+    if (in.GetInt() != MODEL_VERSION)
+    {
+        return false;
+    }
+    int n_preterm = in.GetInt();
+    int n_letters = in.GetInt();
+    int n_digits = in.GetInt();
+    int n_symbols = in.GetInt();
+    total_preterm = in.GetInt();
+
+    int n_pts = in.GetCount();
+    preterminals.reserve(n_pts);
+    for (int id = 0; id < n_pts && in.ok; id += 1)
+    {
+        PT pt;
+        int n_content = in.GetCount();
+        for (int i = 0; i < n_content && in.ok; i += 1)
+        {
+            int type = in.GetInt();
+            int length = in.GetInt();
+            if (type < 1 || type > 3 || length <= 0 || length > in.end - in.curr)
+            {
+                in.ok = false;
+                break;
+            }
+            pt.insert(segment(type, length));
+            pt.curr_indices.emplace_back(0);
+        }
+        int freq = in.GetInt();
+        preterm_freq[AddPT(pt)] = freq;
+    }
+    if (!in.ok || !GetSegments(in, *this, 1) || !GetSegments(in, *this, 2) || !GetSegments(in, *this, 3) ||
+        !PTSegmentsExist(*this))
+    {
+        *this = model();
+        return false;
+    }
+
+    int n_ordered = in.GetCount();
+    ordered_pts.reserve(n_ordered);
+    for (int i = 0; i < n_ordered && in.ok; i += 1)
+    {
+        int id = in.GetInt();
+        if (id < 0 || (size_t)id >= preterminals.size())
+        {
+            in.ok = false;
+            break;
+        }
+        ordered_pts.emplace_back(preterminals[id]);
+        ordered_pts.back().preterm_prob = float(preterm_freq[id]) / total_preterm;
+    }
+    // 计数器必须和各vector的大小一致，否则后续GetNextXXXID会给出错误的id
+    if (!in.ok || in.curr != in.end || n_preterm != preterm_id || n_letters != letters_id ||
+        n_digits != digits_id || n_symbols != symbols_id)
+    {
+        *this = model();
+        return false;
+    }
+    BuildFlat();
+    return true;
+}
+
+bool model::store(string path)
+{
+    string buf;
+    serialize(buf);
+    ofstream out(path, ios::binary);
+    if (!out)
+    {
+        cout << "Cannot open model file " << path << " for writing" << endl;
+        return false;
+    }
+    out.write(buf.data(), buf.size());
+    return bool(out);
+}
+
+bool model::load(string path)
+{
+    ifstream in(path, ios::binary | ios::ate);
+    if (!in)
+    {
+        return false;
+    }
+    string buf(in.tellg(), '\0');
+    in.seekg(0);
+    if (!in.read(&buf[0], buf.size()))
+    {
+        return false;
+    }
+    if (!deserialize(buf.data(), buf.size()))
+    {
+        cout << "Model file " << path << " is corrupted or has an unsupported version" << endl;
+        return false;
+    }
+    return true;
+}
+
+void model::BuildFlat()
+{
+    value_pool.clear();
+    flat_freqs.clear();
+    flat_probs.clear();
+    mapped_pool = nullptr;
+    mapped_freqs = nullptr;
+    mapped_probs = nullptr;
+    mapping.reset();
+    for (int type = 1; type <= 3; type += 1)
+    {
+        for (segment &seg : type_segments(type))
+        {
+            seg.value_count = seg.ordered_values.size();
+            seg.pool_offset = value_pool.size();
+            seg.flat_offset = flat_freqs.size();
+            for (int i = 0; i < seg.value_count; i += 1)
+            {
+                value_pool.append(seg.ordered_values[i]);
+                flat_freqs.emplace_back(seg.ordered_freqs[i]);
+                flat_probs.emplace_back(float(seg.ordered_freqs[i]) / seg.total_freq);
+            }
+        }
+    }
+}
+
+// 可mmap的模型文件格式：文件头之后依次为PT元数据、segment表、字符串池、频数数组、概率数组、ordered_pts下标数组
+// 每个部分都按64字节对齐，映射之后可以直接把对应位置当作int/float数组使用
+static const char MAPPED_MAGIC[8] = {'P', 'C', 'F', 'G', 'M', 'A', 'P', '\0'};
+static const int MAPPED_VERSION = 2;
+
+struct MappedModelHeader
+{
+    char magic[8];
+    int version;
+    int total_preterm;
+    int segment_counts[4]; // 下标1/2/3分别为letters/digits/symbols的数目
+    int ordered_count;
+    int pad;
+    uint64_t pts_offset, pts_size; // 与serialize相同的PT编码：segment数目, (type, length)..., 频数
+    uint64_t segs_offset;          // MappedSegment数组
+    uint64_t pool_offset, pool_size;
+    uint64_t freqs_offset, probs_offset, flat_count;
+    uint64_t ordered_offset;
+    // 训练来源：训练集的路径、大小、修改时间（纳秒）和口令上限，与当前的训练集不一致时不能使用这个文件
+    uint64_t corpus_size;
+    int64_t corpus_mtime;
+    int64_t train_limit;
+    char corpus_path[1024];
+};
+
+struct MappedSegment
+{
+    int type;
+    int length;
+    int freq;
+    int total_freq;
+    int value_count;
+    int pad;
+    uint64_t pool_offset;
+    uint64_t flat_offset;
+};
+
+// 训练集的大小和修改时间，用来判断保存的模型是否由当前的训练集训练得到
+static bool CorpusStamp(const string &path, uint64_t &size, int64_t &mtime)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+    {
+        return false;
+    }
+    size = st.st_size;
+    mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+static void AlignTo64(string &buf)
+{
+    buf.resize((buf.size() + 63) / 64 * 64, '\0');
+}
+
+bool model::store_mapped(string path, string train_path)
+{
+    MappedModelHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAPPED_MAGIC, sizeof(MAPPED_MAGIC));
+    header.version = MAPPED_VERSION;
+    // 路径过长（无法完整记录）时不保存，否则加载时总是不匹配
+    if (train_path.size() >= sizeof(header.corpus_path) ||
+        !CorpusStamp(train_path, header.corpus_size, header.corpus_mtime))
+    {
+        cout << "Cannot record training set " << train_path << " in model file " << path << ", not saving it" << endl;
+        return false;
+    }
+    memcpy(header.corpus_path, train_path.data(), train_path.size());
+    header.train_limit = MAX_TRAIN_PASSWORDS;
+    header.total_preterm = total_preterm;
+    header.ordered_count = ordered_pts.size();
+
+    string buf(sizeof(header), '\0');
+    AlignTo64(buf);
+    header.pts_offset = buf.size();
+    for (size_t id = 0; id < preterminals.size(); id += 1)
+    {
+        PutInt(buf, preterminals[id].content.size());
+        for (const segment &seg : preterminals[id].content)
+        {
+            PutInt(buf, seg.type);
+            PutInt(buf, seg.length);
+        }
+        PutInt(buf, preterm_freq.at(id));
+    }
+    header.pts_size = buf.size() - header.pts_offset;
+
+    AlignTo64(buf);
+    header.segs_offset = buf.size();
+    uint64_t pool_size = 0;
+    uint64_t flat_count = 0;
+    for (int type = 1; type <= 3; type += 1)
+    {
+        vector<segment> &segs = type_segments(type);
+        header.segment_counts[type] = segs.size();
+        for (size_t id = 0; id < segs.size(); id += 1)
+        {
+            MappedSegment rec;
+            memset(&rec, 0, sizeof(rec));
+            rec.type = type;
+            rec.length = segs[id].length;
+            rec.freq = type_freq(type).at(id);
+            rec.total_freq = segs[id].total_freq;
+            rec.value_count = segs[id].value_count;
+            rec.pool_offset = pool_size;
+            rec.flat_offset = flat_count;
+            buf.append((const char *)&rec, sizeof(rec));
+            pool_size += (uint64_t)rec.value_count * rec.length;
+            flat_count += rec.value_count;
+        }
+    }
+
+    // 按segment顺序重新拼接，得到的字符串池和扁平数组与文件中记录的偏移一致（对于mmap加载的模型同样适用）
+    AlignTo64(buf);
+    header.pool_offset = buf.size();
+    header.pool_size = pool_size;
+    for (int type = 1; type <= 3; type += 1)
+    {
+        for (const segment &seg : type_segments(type))
+        {
+            buf.append(ValueAt(seg, 0), (size_t)seg.value_count * seg.length);
+        }
+    }
+    header.flat_count = flat_count;
+    AlignTo64(buf);
+    header.freqs_offset = buf.size();
+    for (int type = 1; type <= 3; type += 1)
+    {
+        for (const segment &seg : type_segments(type))
+        {
+            for (int i = 0; i < seg.value_count; i += 1)
+            {
+                PutInt(buf, FreqAt(seg, i));
+            }
+        }
+    }
+    AlignTo64(buf);
+    header.probs_offset = buf.size();
+    for (int type = 1; type <= 3; type += 1)
+    {
+        for (const segment &seg : type_segments(type))
+        {
+            for (int i = 0; i < seg.value_count; i += 1)
+            {
+                float prob = ProbAt(seg, i);
+                buf.append((const char *)&prob, sizeof(float));
+            }
+        }
+    }
+    AlignTo64(buf);
+    header.ordered_offset = buf.size();
+    for (const PT &pt : ordered_pts)
+    {
+        PutInt(buf, FindPT(pt));
+    }
+    memcpy(&buf[0], &header, sizeof(header));
+
+    ofstream out(path, ios::binary);
+    if (!out)
+    {
+        cout << "Cannot open model file " << path << " for writing" << endl;
+        return false;
+    }
+    out.write(buf.data(), buf.size());
+    return bool(out);
+}
+
+// 文件中[offset, offset + count * elem_size)这一段是否在文件范围之内，计算过程不会溢出
+static bool SectionInFile(uint64_t offset, uint64_t count, uint64_t elem_size, uint64_t size)
+{
+    return offset <= size && count <= (size - offset) / elem_size;
+}
+
+bool model::load_mapped(string path, string train_path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(MappedModelHeader))
+    {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    void *addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        return false;
+    }
+
+    *this = model();
+    mapping = shared_ptr<const void>(addr, [size](const void *p) { munmap(const_cast<void *>(p), size); });
+    const char *base = (const char *)addr;
+    const MappedModelHeader &header = *(const MappedModelHeader *)base;
+    if (memcmp(header.magic, MAPPED_MAGIC, sizeof(MAPPED_MAGIC)) != 0 || header.version != MAPPED_VERSION)
+    {
+        cout << "Model file " << path << " is corrupted or has an unsupported version" << endl;
+        *this = model();
+        return false;
+    }
+    // 训练集被修改、换了训练集或者改了口令上限之后，保存的模型已经过期，需要重新训练
+    uint64_t corpus_size;
+    int64_t corpus_mtime;
+    if (strncmp(header.corpus_path, train_path.c_str(), sizeof(header.corpus_path)) != 0 ||
+        !CorpusStamp(train_path, corpus_size, corpus_mtime) || header.corpus_size != corpus_size ||
+        header.corpus_mtime != corpus_mtime || header.train_limit != MAX_TRAIN_PASSWORDS)
+    {
+        cout << "Model file " << path << " was not trained on the current " << train_path
+             << " (path, size, modification time or password limit changed)" << endl;
+        *this = model();
+        return false;
+    }
+
+    // 检查各部分都在文件范围之内
+    uint64_t n_segs = (uint64_t)header.segment_counts[1] + header.segment_counts[2] + header.segment_counts[3];
+    bool ok = header.segment_counts[1] >= 0 && header.segment_counts[2] >= 0 && header.segment_counts[3] >= 0 &&
+              header.ordered_count >= 0 &&
+              SectionInFile(header.pts_offset, header.pts_size, 1, size) &&
+              SectionInFile(header.segs_offset, n_segs, sizeof(MappedSegment), size) &&
+              SectionInFile(header.pool_offset, header.pool_size, 1, size) &&
+              SectionInFile(header.freqs_offset, header.flat_count, sizeof(int), size) &&
+              SectionInFile(header.probs_offset, header.flat_count, sizeof(float), size) &&
+              SectionInFile(header.ordered_offset, header.ordered_count, sizeof(int), size);
+
+    // PT元数据很小，解析成PT对象；数据量大的value/频数/概率不做任何拷贝
+    total_preterm = header.total_preterm;
+    ModelReader in{base + header.pts_offset, base + header.pts_offset + header.pts_size};
+    while (ok && in.ok && in.curr < in.end)
+    {
+        PT pt;
+        int n_content = in.GetCount();
+        for (int i = 0; i < n_content && in.ok; i += 1)
+        {
+            int type = in.GetInt();
+            int length = in.GetInt();
+            if (type < 1 || type > 3 || length <= 0)
+            {
+                in.ok = false;
+                break;
+            }
+            pt.insert(segment(type, length));
+            pt.curr_indices.emplace_back(0);
+        }
+        int freq = in.GetInt();
+        preterm_freq[AddPT(pt)] = freq;
+    }
+    ok = ok && in.ok;
+
+    const MappedSegment *recs = (const MappedSegment *)(base + header.segs_offset);
+    for (uint64_t i = 0; ok && i < n_segs; i += 1)
+    {
+        const MappedSegment &rec = recs[i];
+        int expected = type_segments(rec.type == 1 || rec.type == 2 ? rec.type : 3).size();
+        // 第i个value位于 pool_offset + i * length，全部value_count个value都必须在字符串池之内
+        // 每个segment至少有一个value，因此过大的length会被这里拒绝，不会用来扩展segment_ids
+        if (rec.type < 1 || rec.type > 3 || rec.length <= 0 || rec.value_count <= 0 ||
+            !SectionInFile(rec.pool_offset, rec.value_count, rec.length, header.pool_size) ||
+            !SectionInFile(rec.flat_offset, rec.value_count, 1, header.flat_count) ||
+            FindOrAddSegment(rec.type, rec.length) != expected)
+        {
+            ok = false;
+            break;
+        }
+        type_freq(rec.type)[expected] = rec.freq;
+        segment &seg = type_segments(rec.type)[expected];
+        seg.total_freq = rec.total_freq;
+        seg.value_count = rec.value_count;
+        seg.pool_offset = rec.pool_offset;
+        seg.flat_offset = rec.flat_offset;
+    }
+
+    // 模型文件与segment表不匹配（例如过期的model.map）时，PT中的segment可能不存在，这样的文件不能使用
+    ok = ok && PTSegmentsExist(*this);
+
+    const int *ordered = (const int *)(base + header.ordered_offset);
+    for (int i = 0; ok && i < header.ordered_count; i += 1)
+    {
+        if (ordered[i] < 0 || (size_t)ordered[i] >= preterminals.size())
+        {
+            ok = false;
+            break;
+        }
+        ordered_pts.emplace_back(preterminals[ordered[i]]);
+        ordered_pts.back().preterm_prob = float(preterm_freq[ordered[i]]) / total_preterm;
+    }
+    if (!ok)
+    {
+        cout << "Model file " << path << " is corrupted or has an unsupported version" << endl;
+        *this = model();
+        return false;
+    }
+    mapped_pool = base + header.pool_offset;
+    mapped_freqs = (const int *)(base + header.freqs_offset);
+    mapped_probs = (const float *)(base + header.probs_offset);
+    return true;
+}